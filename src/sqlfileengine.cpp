@@ -26,491 +26,5223 @@
 #include <QtCore>
 #include <QtSql>
 
+#include <climits>
+#include <sqlite3.h>
+
 #include "sqlfileengine.h"
 
 
-class SqlFileEngineIterator : public QAbstractFileEngineIterator
+static sqlite3 *sqliteHandle(const QSqlDatabase &db)
+{
+    if (!db.isValid())
+        return 0;
+
+    QVariant handle = db.driver()->handle();
+    if (handle.isValid() && qstrcmp(handle.typeName(), "sqlite3*") == 0)
+        return *static_cast<sqlite3 **>(handle.data());
+
+    return 0;
+}
+
+// True while the connection is inside of a transaction, batches included
+static bool inTransaction(const QSqlDatabase &db)
+{
+    sqlite3 *handle = sqliteHandle(db);
+    return handle && !sqlite3_get_autocommit(handle);
+}
+
+// Every other connection to such a database, clones included, gets an
+// empty database of its own
+static bool privateDatabase(const QSqlDatabase &db)
+{
+    QString name = db.databaseName();
+    return name.isEmpty() || name == ":memory:" ||
+            (name.contains("mode=memory") && !name.contains("cache=shared"));
+}
+
+/*
+ * Wraps SQLite's incremental blob I/O. The handle is opened for one column
+ * of one table and moved between rows with open(). Blobs can be read and
+ * written in place at any offset but never change their size.
+ */
+class SqlBlob
 {
 public:
-    SqlFileEngineIterator(SqlFileEngine *engine, QDir::Filters filters,
-                          const QStringList &nameFilters) :
-        QAbstractFileEngineIterator(filters, nameFilters),
-        m_index(-1)
+    SqlBlob(const QSqlDatabase &db, const QString &table, bool writable) :
+        m_handle(sqliteHandle(db)),
+        m_blob(0),
+        m_table(table.toUtf8()),
+        m_writable(writable),
+        m_row(-1)
     {
-        QSqlQuery qry(engine->m_db);
-        qry.prepare(QString("SELECT name "
-                         "FROM %1 "
-                         "WHERE parent=:parent")
-                 .arg(engine->m_tableName));
-        qry.bindValue(":parent", engine->m_nodeId);
-        qry.exec();
+    }
 
-        while (qry.next()) {
-            QString path = qry.value(0).toString();
-            m_list.append(path);
+    ~SqlBlob()
+    {
+        close();
+    }
+
+    // False if the database is not SQLite, callers fall back to SQL then
+    bool isValid() const
+    {
+        return m_handle != 0;
+    }
+
+    bool open(qint64 row)
+    {
+        if (!m_handle)
+            return false;
+
+        if (m_blob && m_row == row)
+            return true;
+
+        if (m_blob && sqlite3_blob_reopen(m_blob, row) == SQLITE_OK) {
+            m_row = row;
+            return true;
         }
+
+        close();
+        if (sqlite3_blob_open(m_handle, "main", m_table.constData(), "data",
+                              row, m_writable ? 1 : 0, &m_blob) != SQLITE_OK) {
+            close();
+            return false;
+        }
+
+        m_row = row;
+        return true;
     }
 
-    bool hasNext() const
+    void close()
     {
-        return m_index < m_list.size() - 1;
+        if (m_blob)
+            sqlite3_blob_close(m_blob);
+        m_blob = 0;
+        m_row = -1;
     }
 
-    QString next()
+    qint64 size() const
     {
-        if (!hasNext())
-            return QString();
+        return m_blob ? sqlite3_blob_bytes(m_blob) : 0;
+    }
 
-        m_index++;
-        return currentFilePath();
+    bool read(char *data, qint64 len, qint64 offset)
+    {
+        return m_blob && sqlite3_blob_read(m_blob, data, static_cast<int>(len),
+                                           static_cast<int>(offset)) == SQLITE_OK;
     }
 
-    QString currentFileName() const
+    bool write(const char *data, qint64 len, qint64 offset)
     {
-        return m_list.at(m_index);
+        return m_blob && sqlite3_blob_write(m_blob, data, static_cast<int>(len),
+                                            static_cast<int>(offset)) == SQLITE_OK;
     }
 
 private:
-    QStringList m_list;
-    int m_index;
-
+    sqlite3 *m_handle;
+    sqlite3_blob *m_blob;
+    QByteArray m_table;
+    bool m_writable;
+    qint64 m_row;
 };
 
-QAbstractFileEngine *SqlFileEngineHandler::create(const QString &fileName) const
+/*
+ * Runs a transaction for its lifetime unless the connection is already in
+ * one, in that case the outer transaction decides. Rolls back if not
+ * committed.
+ */
+class SqlTransaction
 {
-    QRegExp exp("sql:/([^/]+)/([^/]+)(.*)");
-    if (exp.exactMatch(fileName)) {
-        return new SqlFileEngine(fileName);
+public:
+    explicit SqlTransaction(const QSqlDatabase &db) :
+        m_db(db),
+        m_active(false)
+    {
+        sqlite3 *handle = sqliteHandle(m_db);
+        if (!handle || sqlite3_get_autocommit(handle))
+            m_active = m_db.transaction();
+    }
+
+    ~SqlTransaction()
+    {
+        if (m_active)
+            m_db.rollback();
+    }
+
+    bool commit()
+    {
+        if (!m_active)
+            return true;
+
+        m_active = false;
+        return m_db.commit();
     }
-    return NULL;
+
+private:
+    QSqlDatabase m_db;
+    bool m_active;
+};
+
+static void copyChunk(const QByteArray &chunk, qint64 offset, char *data, qint64 len)
+{
+    // Chunks may be shorter than their slot (sparse files)
+    qint64 avail = qBound<qint64>(0, chunk.size() - offset, len);
+    if (avail > 0)
+        memcpy(data, chunk.constData() + offset, avail);
+    if (avail < len)
+        memset(data + avail, 0, len - avail);
 }
 
-SqlFileEngine::SqlFileEngine(const QString &fileName) :
-    QAbstractFileEngine(),
-    m_urlRegExp("sql:/([^/]+)/(.*)"),
-    m_absoluteFileName(fileName)
+
+static QDateTime parseDate(const QVariant &value)
 {
-    m_urlRegExp.exactMatch(fileName);
-    QStringList list = m_urlRegExp.capturedTexts();
-    m_db = QSqlDatabase::database(list[1]);
+    // CURRENT_TIMESTAMP is stored as text in UTC
+    QDateTime date = QDateTime::fromString(value.toString(), "yyyy-MM-dd HH:mm:ss");
+    date.setTimeSpec(Qt::UTC);
+    return date;
+}
 
-    m_filePath  = list[2];
+/*
+ * Metadata of a node as needed to answer stat like calls without touching
+ * its content.
+ */
+struct SqlFsStat
+{
+    SqlFsStat() :
+        flags(0),
+        size(0)
+    {
+    }
 
-    list = splitPath(list[2]);
+    // Reads flags, size, create_date and write_date starting at column
+    SqlFsStat(const QSqlQuery &qry, int column) :
+        flags(qry.value(column).toUInt()),
+        size(qry.value(column + 1).toLongLong()),
+        created(parseDate(qry.value(column + 2))),
+        modified(parseDate(qry.value(column + 3)))
+    {
+    }
 
-    m_tableName = list.first();
-    m_fileName = list.last();
+    uint flags;
+    qint64 size;
+    QDateTime created;
+    QDateTime modified;
+};
 
-    list.removeLast();
-    m_path = list.join('/');
+/*
+ * State shared by all engines working on the same table of the same
+ * connection. Caches the results of path lookups, including misses, as
+ * (parent, name) => node. Only changes made through sqlfs are tracked.
+ * Preloading mounts hold an index of the whole tree instead, which knows
+ * every node and answers misses and listings as well.
+ */
+class SqlFsMount
+{
+public:
+    // Maximum number of cached lookups and stats per mount
+    static const int MaxCachedNodes = 4096;
+    static const int MaxCachedStats = 16384;
 
-    createTable(m_tableName, m_db);
+    SqlFsMount(const QString &name, const QString &tableName) :
+        m_name(name),
+        m_chunkTable(SqlFileEngine::chunkTableName(tableName)),
+        m_blobTable(SqlFileEngine::blobTableName(tableName)),
+        m_checked(false),
+        m_valid(false),
+        m_recursiveLookup(false),
+        m_fullText(false),
+        m_staleText(false),
+        m_preload(false),
+        m_indexed(false),
+        m_generation(0),
+        m_changes(-1)
+    {
+        m_nodes.setMaxCost(MaxCachedNodes);
+        m_stats.setMaxCost(MaxCachedStats);
+    }
 
-    m_nodeId = node(m_filePath);
-    loadFile();
+    // Connection and table name for logs
+    QString name() const
+    {
+        return m_name;
+    }
+
+    // Companion tables, fixed for the lifetime of the mount
+    QString chunkTable() const
+    {
+        return m_chunkTable;
+    }
+
+    QString blobTable() const
+    {
+        return m_blobTable;
+    }
+
+    // Schema checks and migrations run once per mount, valid is false if
+    // they failed
+    bool isChecked(bool *valid = 0)
+    {
+        QMutexLocker locker(&m_mutex);
+        if (valid)
+            *valid = m_valid;
+        return m_checked;
+    }
+
+    void setChecked(bool valid, bool recursiveLookup)
+    {
+        QMutexLocker locker(&m_mutex);
+        m_checked = true;
+        m_valid = valid;
+        m_recursiveLookup = recursiveLookup;
+    }
+
+    // Recursive common table expressions are available since SQLite 3.8.3
+    bool recursiveLookup()
+    {
+        QMutexLocker locker(&m_mutex);
+        return m_recursiveLookup;
+    }
+
+    // Returns false if the lookup is not cached, node is -1 for misses
+    bool lookup(int parent, const QString &name, int *node)
+    {
+        QMutexLocker locker(&m_mutex);
+        if (m_indexed) {
+            count(SqlFsStatistics::NodeCacheHits);
+            QHash<int, QMap<QString, int> >::const_iterator it = m_tree.constFind(parent);
+            *node = it != m_tree.constEnd() ? it->value(name, -1) : -1;
+            return true;
+        }
+
+        int *cached = m_nodes.object(qMakePair(parent, name));
+        if (!cached) {
+            count(SqlFsStatistics::NodeCacheMisses);
+            return false;
+        }
+        count(SqlFsStatistics::NodeCacheHits);
+        *node = *cached;
+        return true;
+    }
+
+    void insert(int parent, const QString &name, int node)
+    {
+        QMutexLocker locker(&m_mutex);
+        m_generation++;
+        if (m_indexed) {
+            if (node >= 0)
+                m_tree[parent].insert(name, node);
+            return;
+        }
+        m_nodes.insert(qMakePair(parent, name), new int(node));
+    }
+
+    void remove(int parent, const QString &name)
+    {
+        QMutexLocker locker(&m_mutex);
+        m_generation++;
+        if (m_indexed) {
+            QHash<int, QMap<QString, int> >::iterator it = m_tree.find(parent);
+            if (it != m_tree.end() && it->contains(name))
+                m_indexStats.remove(it->take(name));
+            return;
+        }
+        m_nodes.remove(qMakePair(parent, name));
+    }
+
+    // Names of all children of a node, false if the mount has no index
+    bool children(int parent, QStringList *names)
+    {
+        QMutexLocker locker(&m_mutex);
+        if (!m_indexed)
+            return false;
+        *names = m_tree.value(parent).keys();
+        return true;
+    }
+
+    // Stats are filled by directory listings and stat calls and dropped
+    // whenever a node changes.
+    bool stat(int node, SqlFsStat *stat)
+    {
+        QMutexLocker locker(&m_mutex);
+        if (m_indexed) {
+            QHash<int, SqlFsStat>::const_iterator it = m_indexStats.constFind(node);
+            if (it != m_indexStats.constEnd()) {
+                count(SqlFsStatistics::StatCacheHits);
+                *stat = *it;
+                return true;
+            }
+        }
+
+        SqlFsStat *cached = m_stats.object(node);
+        if (!cached) {
+            count(SqlFsStatistics::StatCacheMisses);
+            return false;
+        }
+        count(SqlFsStatistics::StatCacheHits);
+        *stat = *cached;
+        return true;
+    }
+
+    void insertStat(int node, const SqlFsStat &stat)
+    {
+        QMutexLocker locker(&m_mutex);
+        m_generation++;
+        if (m_indexed)
+            m_indexStats.insert(node, stat);
+        else
+            m_stats.insert(node, new SqlFsStat(stat));
+    }
+
+    void removeStat(int node)
+    {
+        QMutexLocker locker(&m_mutex);
+        m_generation++;
+        m_indexStats.remove(node);
+        m_stats.remove(node);
+        m_pinned.remove(node);
+    }
+
+    // Contents of mapped files are shared by all mappings of a node while
+    // any of them exists. Pins content if given and the node has none yet,
+    // returns the pinned content or a null QByteArray.
+    QByteArray pin(int node, const QByteArray &content = QByteArray())
+    {
+        QMutexLocker locker(&m_mutex);
+        QHash<int, QPair<QByteArray, int> >::iterator it = m_pinned.find(node);
+        if (it != m_pinned.end()) {
+            it->second++;
+            return it->first;
+        }
+        if (!content.isNull())
+            m_pinned.insert(node, qMakePair(content, 1));
+        return content;
+    }
+
+    void unpin(int node, const QByteArray &content)
+    {
+        QMutexLocker locker(&m_mutex);
+        QHash<int, QPair<QByteArray, int> >::iterator it = m_pinned.find(node);
+        // Content replaced since is not touched, mappings keep their copy
+        if (it != m_pinned.end() && it->first.constData() == content.constData() &&
+                --it->second == 0)
+            m_pinned.erase(it);
+    }
+
+    // Later mappings of a changed node load it again
+    void unpinAll(int node)
+    {
+        QMutexLocker locker(&m_mutex);
+        m_pinned.remove(node);
+    }
+
+    // Required whenever a whole subtree vanishes, rowids may be reused.
+    // The index is loaded again by the next engine.
+    void clear()
+    {
+        QMutexLocker locker(&m_mutex);
+        m_generation++;
+        m_nodes.clear();
+        m_stats.clear();
+        m_pinned.clear();
+        clearIndex();
+    }
+
+    // Loaded again by the next engine, for changes the index cannot follow
+    void dropIndex()
+    {
+        QMutexLocker locker(&m_mutex);
+        m_generation++;
+        clearIndex();
+    }
+
+    bool preloads()
+    {
+        QMutexLocker locker(&m_mutex);
+        return m_preload;
+    }
+
+    // Contents of files are kept in the text table
+    bool indexesText()
+    {
+        QMutexLocker locker(&m_mutex);
+        return m_fullText;
+    }
+
+    // The text table missed changes while the option was off
+    bool staleText()
+    {
+        QMutexLocker locker(&m_mutex);
+        return m_staleText;
+    }
+
+    void setStaleText(bool stale)
+    {
+        QMutexLocker locker(&m_mutex);
+        m_staleText = stale;
+    }
+
+    // Returns true if the index is current for a connection which sees the
+    // given data version. Versions of a connection only change with
+    // commits of other connections, they are recorded when the index is
+    // built or validated on it. Otherwise generation is set to pass to
+    // setIndex() or validateIndex() and changes to the change counter of
+    // the table the index was built at, -1 if it has to be built.
+    bool checkIndex(const QString &connectionName, qint64 dataVersion,
+                    quint64 *generation, qint64 *changes)
+    {
+        QMutexLocker locker(&m_mutex);
+        *changes = -1;
+        if (m_indexed) {
+            QHash<QString, qint64>::iterator it = m_dataVersions.find(connectionName);
+            if (it == m_dataVersions.end())
+                *changes = m_changes;
+            else if (it.value() == dataVersion)
+                return true;
+            else
+                clearIndex();
+        }
+        *generation = m_generation;
+        return false;
+    }
+
+    // Installs a loaded index unless the mount changed since generation
+    void setIndex(const QHash<int, QMap<QString, int> > &tree,
+                  const QHash<int, SqlFsStat> &stats, qint64 changes,
+                  const QString &connectionName, qint64 dataVersion, quint64 generation)
+    {
+        QMutexLocker locker(&m_mutex);
+        if (!m_preload || generation != m_generation)
+            return;
+        m_tree = tree;
+        m_indexStats = stats;
+        m_changes = changes;
+        m_dataVersions.clear();
+        m_dataVersions.insert(connectionName, dataVersion);
+        m_indexed = true;
+        m_nodes.clear();
+        m_stats.clear();
+    }
+
+    // Takes the index as current for a connection which found the change
+    // counter it was built at
+    bool validateIndex(const QString &connectionName, qint64 dataVersion,
+                       quint64 generation)
+    {
+        QMutexLocker locker(&m_mutex);
+        if (!m_indexed || generation != m_generation)
+            return false;
+        m_dataVersions.insert(connectionName, dataVersion);
+        return true;
+    }
+
+    SqlFsMountOptions options()
+    {
+        QMutexLocker locker(&m_mutex);
+        return m_options;
+    }
+
+    void setOptions(const SqlFsMountOptions &options)
+    {
+        QMutexLocker locker(&m_mutex);
+        m_options = options;
+        m_preload = options.preload;
+        if (m_fullText && !options.fullText)
+            m_staleText = true;
+        m_fullText = options.fullText;
+        if (!m_preload)
+            clearIndex();
+    }
+
+    // Statistics are atomic and never take the mount lock
+    void count(SqlFsStatistics::Counter counter, qint64 n = 1)
+    {
+        m_counters[counter].fetchAndAddRelaxed(n);
+    }
+
+    void countStatement(int statement)
+    {
+        m_statements[statement].fetchAndAddRelaxed(1);
+    }
+
+    void addLatency(SqlFsStatistics::Operation operation, qint64 usecs)
+    {
+        int bucket = 0;
+        for (qint64 n = usecs; n > 0 && bucket < SqlFsStatistics::LatencyBuckets - 1; n >>= 1)
+            bucket++;
+        m_latencies[operation][bucket].fetchAndAddRelaxed(1);
+    }
+
+    SqlFsStatistics statistics()
+    {
+        SqlFsStatistics statistics;
+        for (int i = 0; i < SqlFsStatistics::CounterCount; i++)
+            statistics.counters[i] = m_counters[i].loadAcquire();
+        for (int i = 0; i < SqlFileEngineHandler::StatementCount; i++)
+            statistics.statements[i] = m_statements[i].loadAcquire();
+        for (int i = 0; i < SqlFsStatistics::OperationCount; i++) {
+            for (int j = 0; j < SqlFsStatistics::LatencyBuckets; j++)
+                statistics.latencies[i][j] = m_latencies[i][j].loadAcquire();
+        }
+        return statistics;
+    }
+
+    void resetStatistics()
+    {
+        for (int i = 0; i < SqlFsStatistics::CounterCount; i++)
+            m_counters[i].fetchAndStoreRelaxed(0);
+        for (int i = 0; i < SqlFileEngineHandler::StatementCount; i++)
+            m_statements[i].fetchAndStoreRelaxed(0);
+        for (int i = 0; i < SqlFsStatistics::OperationCount; i++) {
+            for (int j = 0; j < SqlFsStatistics::LatencyBuckets; j++)
+                m_latencies[i][j].fetchAndStoreRelaxed(0);
+        }
+    }
+
+private:
+    // Callers hold the mutex
+    void clearIndex()
+    {
+        m_indexed = false;
+        m_tree.clear();
+        m_indexStats.clear();
+    }
+
+    const QString m_name;
+    const QString m_chunkTable;
+    const QString m_blobTable;
+    QMutex m_mutex;
+    SqlFsMountOptions m_options;
+    QCache<QPair<int, QString>, int> m_nodes;
+    QCache<int, SqlFsStat> m_stats;
+    QHash<int, QPair<QByteArray, int> > m_pinned;
+    bool m_checked;
+    bool m_valid;
+    bool m_recursiveLookup;
+    bool m_fullText;
+    bool m_staleText;
+    bool m_preload;
+    bool m_indexed;
+    quint64 m_generation;
+    // Children by name of every node of an indexed mount, the root is
+    // the child of -1
+    QHash<int, QMap<QString, int> > m_tree;
+    QHash<int, SqlFsStat> m_indexStats;
+    // Change counter of the table in sqlfs_meta the index was built at and
+    // data versions of the connections it is known to be current for
+    qint64 m_changes;
+    QHash<QString, qint64> m_dataVersions;
+    QAtomicInteger<qint64> m_counters[SqlFsStatistics::CounterCount];
+    QAtomicInteger<qint64> m_statements[SqlFileEngineHandler::StatementCount];
+    QAtomicInteger<qint64> m_latencies[SqlFsStatistics::OperationCount][SqlFsStatistics::LatencyBuckets];
+};
+
+/*
+ * Records the latency of an operation on a mount when it goes out of
+ * scope and logs operations slower than SlowOperation.
+ */
+class SqlFsTimer
+{
+public:
+    static const qint64 SlowOperation = 100000;
+
+    SqlFsTimer(SqlFsMount *mount, SqlFsStatistics::Operation operation) :
+        m_mount(mount),
+        m_operation(operation)
+    {
+        m_timer.start();
+    }
+
+    ~SqlFsTimer()
+    {
+        if (!m_mount)
+            return;
+
+        static const char *const names[] = { "open", "read", "flush", "list" };
+        qint64 usecs = m_timer.nsecsElapsed() / 1000;
+        m_mount->addLatency(m_operation, usecs);
+        if (usecs >= SlowOperation)
+            qCDebug(lcSqlFs, "%s: slow %s took %lld ms", qPrintable(m_mount->name()),
+                    names[m_operation], usecs / 1000);
+    }
+
+private:
+    SqlFsMount *m_mount;
+    SqlFsStatistics::Operation m_operation;
+    QElapsedTimer m_timer;
+};
+
+static sqlite3_stmt *statementHandle(const QSqlQuery *qry)
+{
+    QVariant handle = qry->result()->handle();
+    if (handle.isValid() && qstrcmp(handle.typeName(), "sqlite3_stmt*") == 0)
+        return *static_cast<sqlite3_stmt *const *>(handle.constData());
+
+    return 0;
 }
 
-SqlFileEngine::~SqlFileEngine()
+Q_LOGGING_CATEGORY(lcSqlFs, "sqlfs", QtWarningMsg)
+Q_LOGGING_CATEGORY(lcSqlFsQuery, "sqlfs.query", QtWarningMsg)
+
+SqlFsStatistics::SqlFsStatistics() :
+    statements(SqlFileEngineHandler::StatementCount, 0)
 {
+    memset(counters, 0, sizeof(counters));
+    memset(latencies, 0, sizeof(latencies));
 }
 
-QAbstractFileEngine::FileFlags SqlFileEngine::fileFlags(QAbstractFileEngine::FileFlags type) const
+double SqlFsStatistics::hitRate(qint64 hits, qint64 misses)
 {
-    Q_UNUSED(type);
+    if (hits + misses == 0)
+        return 0;
+    return double(hits) / (hits + misses);
+}
 
-    FileFlags ret = 0;
+qint64 SqlFsStatistics::calls(Operation operation) const
+{
+    qint64 total = 0;
+    for (int i = 0; i < LatencyBuckets; i++)
+        total += latencies[operation][i];
+    return total;
+}
 
-    if (m_filePath.isEmpty()) {
-        ret = DirectoryType | ExistsFlag | ReadUserPerm | WriteUserPerm;
-    } else {
-        QSqlQuery qry(m_db);
-        qry.prepare(QString("SELECT flags FROM %1 WHERE rowid=:nodeid")
-                    .arg(m_tableName));
-        qry.bindValue(":nodeid", m_nodeId);
-        if (qry.exec() && qry.next())
-            ret = static_cast<FileFlags>(qry.value(0).toUInt());
-    }
+qint64 SqlFsStatistics::percentile(Operation operation, double fraction) const
+{
+    qint64 total = calls(operation);
+    if (!total)
+        return 0;
 
-    return ret;
+    qint64 rank = qMax(qint64(1), qint64(qCeil(total * fraction)));
+    qint64 seen = 0;
+    for (int i = 0; i < LatencyBuckets; i++) {
+        seen += latencies[operation][i];
+        if (seen >= rank)
+            return qint64(1) << i;
+    }
+    return qint64(1) << (LatencyBuckets - 1);
 }
 
-QString SqlFileEngine::fileName(QAbstractFileEngine::FileName file) const
+QString SqlFsStatistics::toString() const
 {
-    switch (file) {
-    case DefaultName:
-    case AbsoluteName:
-        return m_absoluteFileName;
+    static const char *const names[] = { "open", "read", "flush", "list" };
 
-    default:
-        qDebug() << "DEFAULT" << file;
+    qint64 executed = 0;
+    foreach (qint64 count, statements)
+        executed += count;
 
+    QString result = QString("%1 engines, %2 lookups of %3 components, %4 statements, "
+                             "node cache %5%, stat cache %6%, chunk cache %7%, "
+                             "%8 bytes read, %9 bytes written, %10 bytes flushed")
+            .arg(counters[Engines])
+            .arg(counters[Lookups])
+            .arg(counters[LookupSteps])
+            .arg(executed)
+            .arg(100 * hitRate(counters[NodeCacheHits], counters[NodeCacheMisses]), 0, 'f', 1)
+            .arg(100 * hitRate(counters[StatCacheHits], counters[StatCacheMisses]), 0, 'f', 1)
+            .arg(100 * hitRate(counters[ChunkCacheHits], counters[ChunkCacheMisses]), 0, 'f', 1)
+            .arg(counters[BytesRead])
+            .arg(counters[BytesWritten])
+            .arg(counters[BytesFlushed]);
+
+    for (int i = 0; i < OperationCount; i++) {
+        Operation operation = Operation(i);
+        if (!calls(operation))
+            continue;
+        result += QString(", %1 %2x p50 <%3 us p99 <%4 us")
+                .arg(names[i])
+                .arg(calls(operation))
+                .arg(percentile(operation, 0.5))
+                .arg(percentile(operation, 0.99));
     }
+    return result;
+}
 
-    return m_absoluteFileName;
+SqlFsMountOptions::SqlFsMountOptions() :
+    mmapSize(0),
+    cacheSize(0),
+    pageSize(0),
+    flushPolicy(FlushAlways),
+    flushInterval(1000),
+    writeBehind(false),
+    deduplicate(false),
+    vacuumPages(1024),
+    preload(false),
+    fullText(false)
+{
 }
 
-QAbstractFileEngine::Iterator *SqlFileEngine::beginEntryList(
-        QDir::Filters filters, const QStringList &filterNames)
+bool SqlFsMountOptions::operator==(const SqlFsMountOptions &other) const
+{
+    return journalMode == other.journalMode &&
+            synchronous == other.synchronous &&
+            mmapSize == other.mmapSize &&
+            cacheSize == other.cacheSize &&
+            pageSize == other.pageSize &&
+            flushPolicy == other.flushPolicy &&
+            flushInterval == other.flushInterval &&
+            writeBehind == other.writeBehind &&
+            deduplicate == other.deduplicate &&
+            compression == other.compression &&
+            autoVacuum == other.autoVacuum &&
+            vacuumPages == other.vacuumPages &&
+            preload == other.preload &&
+            fullText == other.fullText;
+}
+
+bool SqlFsMountOptions::operator!=(const SqlFsMountOptions &other) const
+{
+    return !(*this == other);
+}
+
+bool SqlFsMountOptions::parse(const QString &query)
+{
+    // Values end up in pragma statements, only known ones are accepted
+    static const QRegExp journalModes("DELETE|TRUNCATE|PERSIST|MEMORY|WAL|OFF",
+                                      Qt::CaseInsensitive);
+    static const QRegExp synchronousLevels("OFF|NORMAL|FULL|EXTRA|[0-3]",
+                                           Qt::CaseInsensitive);
+    static const QRegExp codecNames("[A-Za-z0-9_-]*");
+    static const QRegExp vacuumModes("NONE|FULL|INCREMENTAL", Qt::CaseInsensitive);
+
+    bool ok = true;
+    foreach (const QString &item, query.split('&', QString::SkipEmptyParts)) {
+        QString key = item.section('=', 0, 0);
+        QString value = item.section('=', 1);
+        bool valid = true;
+
+        if (key == "journal_mode" && journalModes.exactMatch(value)) {
+            journalMode = value.toUpper();
+        } else if (key == "synchronous" && synchronousLevels.exactMatch(value)) {
+            synchronous = value.toUpper();
+        } else if (key == "mmap_size") {
+            mmapSize = value.toLongLong(&valid);
+        } else if (key == "cache_size") {
+            cacheSize = value.toInt(&valid);
+        } else if (key == "page_size") {
+            pageSize = value.toInt(&valid);
+        } else if (key == "flush" && value == "always") {
+            flushPolicy = FlushAlways;
+        } else if (key == "flush" && value == "close") {
+            flushPolicy = FlushOnClose;
+        } else if (key == "flush" && value == "timed") {
+            flushPolicy = FlushTimed;
+        } else if (key == "flush_interval") {
+            flushInterval = value.toInt(&valid);
+        } else if (key == "write_behind" && (value == "1" || value == "true")) {
+            writeBehind = true;
+        } else if (key == "write_behind" && (value == "0" || value == "false")) {
+            writeBehind = false;
+        } else if (key == "dedup" && (value == "1" || value == "true")) {
+            deduplicate = true;
+        } else if (key == "dedup" && (value == "0" || value == "false")) {
+            deduplicate = false;
+        } else if (key == "compress" && codecNames.exactMatch(value)) {
+            compression = value;
+        } else if (key == "auto_vacuum" && vacuumModes.exactMatch(value)) {
+            autoVacuum = value.toUpper();
+        } else if (key == "vacuum_pages") {
+            vacuumPages = value.toInt(&valid);
+        } else if (key == "preload" && (value == "1" || value == "true")) {
+            preload = true;
+        } else if (key == "preload" && (value == "0" || value == "false")) {
+            preload = false;
+        } else if (key == "fulltext" && (value == "1" || value == "true")) {
+            fullText = true;
+        } else if (key == "fulltext" && (value == "0" || value == "false")) {
+            fullText = false;
+        } else {
+            valid = false;
+        }
+
+        if (!valid) {
+            qWarning("sqlfs: invalid mount option %s", qPrintable(item));
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+static void applyPragmas(QSqlDatabase db, const SqlFsMountOptions &options)
+{
+    QSqlQuery qry(db);
+
+    // The page size has to be set before WAL mode is entered
+    if (options.pageSize > 0)
+        qry.exec(QString("PRAGMA page_size = %1").arg(options.pageSize));
+    if (!options.autoVacuum.isEmpty()) {
+        static const QStringList modes = QStringList() << "NONE" << "FULL" << "INCREMENTAL";
+        qry.exec(QString("PRAGMA auto_vacuum = %1").arg(options.autoVacuum));
+        // Databases with tables only switch modes with a full VACUUM
+        if (qry.exec("PRAGMA auto_vacuum") && qry.next() &&
+                qry.value(0).toInt() != modes.indexOf(options.autoVacuum))
+            qWarning("sqlfs: auto_vacuum of %s changes with the next VACUUM",
+                     qPrintable(db.databaseName()));
+        qry.finish();
+    }
+    if (!options.journalMode.isEmpty())
+        qry.exec(QString("PRAGMA journal_mode = %1").arg(options.journalMode));
+    if (!options.synchronous.isEmpty())
+        qry.exec(QString("PRAGMA synchronous = %1").arg(options.synchronous));
+    if (options.mmapSize > 0)
+        qry.exec(QString("PRAGMA mmap_size = %1").arg(options.mmapSize));
+    if (options.cacheSize != 0)
+        qry.exec(QString("PRAGMA cache_size = %1").arg(options.cacheSize));
+    qry.finish();
+}
+
+// Connections used by one thread and the statements prepared on them,
+// clones are removed when it exits
+class SqlFsThreadConnections
+{
+public:
+    // Statements of one connection by table name
+    typedef QHash<QString, QVector<QSqlQuery *> > Statements;
+
+    SqlFsThreadConnections(const SqlFileEngineHandler *handler) :
+        m_handler(handler)
+    {
+    }
+
+    ~SqlFsThreadConnections()
+    {
+        releaseStatements();
+
+        QHash<QString, QString>::const_iterator it;
+        for (it = names.constBegin(); it != names.constEnd(); ++it) {
+            if (it.key() != it.value())
+                m_handler->releaseClone(it.value());
+        }
+    }
+
+    // Statements of a connection, all of them for an empty name
+    void releaseStatements(const QString &connectionName = QString())
+    {
+        QMutableHashIterator<QString, Statements> it(statements);
+        while (it.hasNext()) {
+            it.next();
+            if (!connectionName.isEmpty() && it.key() != connectionName)
+                continue;
+            foreach (const QVector<QSqlQuery *> &queries, it.value()) {
+                foreach (QSqlQuery *qry, queries) {
+                    if (qry)
+                        deleteQuery(qry);
+                }
+            }
+            untrace(it.key());
+            it.remove();
+        }
+    }
+
+    void deleteQuery(QSqlQuery *qry)
+    {
+        if (!m_tracedStatements.isEmpty())
+            m_tracedStatements.remove(statementHandle(qry));
+        delete qry;
+    }
+
+    // Logs the executions of a statement to "sqlfs.query". SQLite keeps
+    // one trace callback per connection and offers no way to read it, the
+    // hook replaces any of the application until untrace().
+    void trace(const QSqlDatabase &db, QSqlQuery *qry, const QString &tableName)
+    {
+        sqlite3 *handle = sqliteHandle(db);
+        sqlite3_stmt *statement = statementHandle(qry);
+        if (!handle || !statement)
+            return;
+
+        sqlite3 *&traced = m_traced[db.connectionName()];
+        if (traced != handle) {
+            sqlite3_trace_v2(handle, SQLITE_TRACE_STMT, traceStatement, this);
+            traced = handle;
+        }
+        m_tracedStatements.insert(statement, db.connectionName() + '/' + tableName);
+    }
+
+    // Registered connection name mapped to the one used by this thread
+    QHash<QString, QString> names;
+    // Prepared statements by connection name, only used by this thread
+    QHash<QString, Statements> statements;
+
+private:
+    // Connections run their callbacks in their thread, no lock needed
+    static int traceStatement(unsigned type, void *context, void *statement, void *sql)
+    {
+        // Trigger programs are reported as comments along with the statement
+        // running them
+        if (type != SQLITE_TRACE_STMT || qstrncmp(static_cast<const char *>(sql), "--", 2) == 0)
+            return 0;
+
+        SqlFsThreadConnections *connections = static_cast<SqlFsThreadConnections *>(context);
+        QHash<sqlite3_stmt *, QString>::const_iterator it =
+                connections->m_tracedStatements.constFind(static_cast<sqlite3_stmt *>(statement));
+        if (it != connections->m_tracedStatements.constEnd())
+            qCDebug(lcSqlFsQuery, "%s: %s", qPrintable(*it), static_cast<const char *>(sql));
+        return 0;
+    }
+
+    void untrace(const QString &connectionName)
+    {
+        sqlite3 *traced = m_traced.take(connectionName);
+        if (traced && sqliteHandle(QSqlDatabase::database(connectionName, false)) == traced)
+            sqlite3_trace_v2(traced, 0, 0, 0);
+    }
+
+    const SqlFileEngineHandler *m_handler;
+    // Traced connections and statements with their connection and table
+    QHash<QString, sqlite3 *> m_traced;
+    QHash<sqlite3_stmt *, QString> m_tracedStatements;
+};
+
+// Transaction opened by SqlFsBatch on one connection
+struct SqlFsBatchState
+{
+    QSqlDatabase db;
+    int depth;
+    int maxOps;
+    qint64 maxBytes;
+    int ops;
+    qint64 bytes;
+    bool failed;
+};
+
+class SqlFsZlibCodec : public SqlFsCodec
+{
+public:
+    int id() const
+    {
+        return 1;
+    }
+
+    QString name() const
+    {
+        return "zlib";
+    }
+
+    QByteArray encode(const QByteArray &data) const
+    {
+        return qCompress(data);
+    }
+
+    QByteArray decode(const QByteArray &data) const
+    {
+        return qUncompress(data);
+    }
+};
+
+// Writes a whole chunk, encoded by codec unless it is null. Deduplicated
+// chunks are never modified in place, the chunk row is pointed to the
+// blob of the new content instead (copy on write), triggers keep the
+// reference counts.
+static bool storeChunk(const SqlFileEngineHandler *handler, const QSqlDatabase &db,
+                       SqlFsMount *mount, const QString &tableName, int node, qint64 idx,
+                       const QByteArray &chunk, bool deduplicate,
+                       const SqlFsCodec *codec)
+{
+    // Encoding only pays off if it saves something
+    QByteArray data = chunk;
+    QVariant encoding(QVariant::Int);
+    QVariant length(QVariant::LongLong);
+    if (codec) {
+        QByteArray encoded = codec->encode(chunk);
+        if (encoded.size() < chunk.size()) {
+            data = encoded;
+            encoding = codec->id();
+            length = chunk.size();
+        }
+    }
+
+    if (deduplicate) {
+        // The encoding is part of the content, equal bytes decode differently
+        QCryptographicHash hasher(QCryptographicHash::Sha256);
+        hasher.addData(QByteArray::number(encoding.toInt()) + ':');
+        hasher.addData(data);
+        QByteArray hash = hasher.result();
+
+        QSqlQuery &blob = handler->query(db, tableName, SqlFileEngineHandler::InsertBlob,
+                                         mount);
+        blob.bindValue(":hash", hash);
+        blob.bindValue(":data", data);
+        if (!blob.exec())
+            return false;
+
+        QSqlQuery &update = handler->query(db, tableName,
+                                           SqlFileEngineHandler::UpdateChunkBlob, mount);
+        update.bindValue(":hash", hash);
+        update.bindValue(":encoding", encoding);
+        update.bindValue(":length", length);
+        update.bindValue(":node", node);
+        update.bindValue(":idx", idx);
+        if (!update.exec())
+            return false;
+        if (update.numRowsAffected() > 0)
+            return true;
+
+        QSqlQuery &insert = handler->query(db, tableName,
+                                           SqlFileEngineHandler::InsertChunkBlob, mount);
+        insert.bindValue(":node", node);
+        insert.bindValue(":idx", idx);
+        insert.bindValue(":encoding", encoding);
+        insert.bindValue(":length", length);
+        insert.bindValue(":hash", hash);
+        return insert.exec();
+    }
+
+    // Updated rather than replaced, REPLACE would bypass the delete trigger
+    // of chunks referencing a blob
+    QSqlQuery &update = handler->query(db, tableName, SqlFileEngineHandler::UpdateChunk,
+                                       mount);
+    update.bindValue(":data", data);
+    update.bindValue(":encoding", encoding);
+    update.bindValue(":length", length);
+    update.bindValue(":node", node);
+    update.bindValue(":idx", idx);
+    if (!update.exec())
+        return false;
+    if (update.numRowsAffected() > 0)
+        return true;
+
+    QSqlQuery &insert = handler->query(db, tableName, SqlFileEngineHandler::ReplaceChunk,
+                                       mount);
+    insert.bindValue(":node", node);
+    insert.bindValue(":idx", idx);
+    insert.bindValue(":data", data);
+    insert.bindValue(":encoding", encoding);
+    insert.bindValue(":length", length);
+    return insert.exec();
+}
+
+// Text of a file for the text index, files with NUL bytes or invalid
+// UTF-8 are taken as binary
+static bool decodeText(const QByteArray &content, QString *text)
+{
+    if (content.contains('\0'))
+        return false;
+
+    QTextCodec::ConverterState state;
+    QString decoded = QTextCodec::codecForName("UTF-8")->toUnicode(content.constData(),
+                                                                   content.size(), &state);
+    if (state.invalidChars > 0 || state.remainingChars > 0)
+        return false;
+
+    *text = decoded;
+    return true;
+}
+
+// Replaces the indexed text of a node, empty text only removes it
+static bool storeText(const SqlFileEngineHandler *handler, const QSqlDatabase &db,
+                      SqlFsMount *mount, const QString &tableName, int node,
+                      const QString &text)
+{
+    QSqlQuery &remove = handler->query(db, tableName, SqlFileEngineHandler::DeleteText, mount);
+    remove.bindValue(":node", node);
+    if (!remove.exec())
+        return false;
+    if (text.isEmpty())
+        return true;
+
+    QSqlQuery &insert = handler->query(db, tableName, SqlFileEngineHandler::InsertText, mount);
+    insert.bindValue(":node", node);
+    insert.bindValue(":content", text);
+    return insert.exec();
+}
+
+// Contents handed over by close() on write-behind mounts
+struct SqlFsPendingWrite
+{
+    QString connectionName;
+    QString tableName;
+    SqlFsMount *mount;
+    int node;
+    bool deduplicate;
+    const SqlFsCodec *codec;
+    qint64 size;
+    bool truncate;
+    qint64 truncateIdx;
+    QHash<qint64, QByteArray> chunks;
+    // Text replacing the indexed one of the node if fullText is set
+    bool fullText;
+    QString text;
+
+    // Folds a later write of the same node into this one
+    void merge(const SqlFsPendingWrite &other)
+    {
+        if (other.truncate) {
+            QMutableHashIterator<qint64, QByteArray> it(chunks);
+            while (it.hasNext()) {
+                it.next();
+                if (it.key() > other.truncateIdx)
+                    it.remove();
+            }
+            truncateIdx = truncate ? qMin(truncateIdx, other.truncateIdx)
+                                   : other.truncateIdx;
+            truncate = true;
+        }
+
+        QHash<qint64, QByteArray>::const_iterator it;
+        for (it = other.chunks.constBegin(); it != other.chunks.constEnd(); ++it)
+            chunks.insert(it.key(), it.value());
+        size = other.size;
+        fullText = other.fullText;
+        text = other.text;
+    }
+};
+
+/*
+ * Single thread committing the contents of write-behind mounts. Writes
+ * to the same node are coalesced while queued, everything queued at once
+ * is committed in one transaction per connection. The queue is drained
+ * on destruction.
+ */
+class SqlFsWriter : public QThread
+{
+public:
+    typedef QPair<SqlFsMount *, int> Key;
+
+    SqlFsWriter(const SqlFileEngineHandler *handler) :
+        m_handler(handler),
+        m_stop(false),
+        m_failed(false)
+    {
+    }
+
+    ~SqlFsWriter()
+    {
+        {
+            QMutexLocker locker(&m_mutex);
+            m_stop = true;
+            m_queued.wakeAll();
+        }
+        wait();
+    }
+
+    void enqueue(const SqlFsPendingWrite &write)
+    {
+        Key key(write.mount, write.node);
+
+        QMutexLocker locker(&m_mutex);
+        QHash<Key, SqlFsPendingWrite>::iterator it = m_pending.find(key);
+        if (it != m_pending.end()) {
+            it.value().merge(write);
+        } else {
+            m_pending.insert(key, write);
+            m_order.append(key);
+        }
+        m_queued.wakeAll();
+    }
+
+    // Blocks while anything of the node, of the mount for a node of -1 or
+    // of any mount for a null mount is queued.
+    void waitFor(SqlFsMount *mount, int node)
+    {
+        QMutexLocker locker(&m_mutex);
+        while (isPending(mount, node))
+            m_written.wait(&m_mutex);
+    }
+
+    bool sync()
+    {
+        QMutexLocker locker(&m_mutex);
+        while (isPending(0, -1))
+            m_written.wait(&m_mutex);
+
+        bool ok = !m_failed;
+        m_failed = false;
+        return ok;
+    }
+
+    // Drops the writer's clone of a connection after draining the queue
+    void release(const QString &connectionName)
+    {
+        QMutexLocker locker(&m_mutex);
+        m_released.append(connectionName);
+        m_queued.wakeAll();
+        while (isPending(0, -1) || m_released.contains(connectionName))
+            m_written.wait(&m_mutex);
+    }
+
+protected:
+    void run()
+    {
+        QMutexLocker locker(&m_mutex);
+        forever {
+            while (m_order.isEmpty() && m_released.isEmpty() && !m_stop)
+                m_queued.wait(&m_mutex);
+
+            if (m_order.isEmpty() && m_released.isEmpty())
+                break;
+
+            QList<Key> order = m_order;
+            QStringList released = m_released;
+            QHash<Key, SqlFsPendingWrite> writing = m_pending;
+            m_writing = writing;
+            m_pending.clear();
+            m_order.clear();
+
+            locker.unlock();
+            bool ok = write(order, writing);
+            foreach (const QString &connectionName, released)
+                m_handler->releaseThreadConnection(connectionName);
+            locker.relock();
+
+            if (!ok)
+                m_failed = true;
+            m_writing.clear();
+            m_released = m_released.mid(released.size());
+            m_written.wakeAll();
+        }
+    }
+
+private:
+    bool isPending(SqlFsMount *mount, int node) const
+    {
+        if (!mount)
+            return !m_pending.isEmpty() || !m_writing.isEmpty();
+
+        if (node >= 0)
+            return m_pending.contains(Key(mount, node)) ||
+                    m_writing.contains(Key(mount, node));
+
+        QHash<Key, SqlFsPendingWrite>::const_iterator it;
+        for (it = m_pending.constBegin(); it != m_pending.constEnd(); ++it) {
+            if (it.key().first == mount)
+                return true;
+        }
+        for (it = m_writing.constBegin(); it != m_writing.constEnd(); ++it) {
+            if (it.key().first == mount)
+                return true;
+        }
+        return false;
+    }
+
+    bool write(const QList<Key> &order, const QHash<Key, SqlFsPendingWrite> &writing)
+    {
+        QStringList connections;
+        QHash<QString, QList<Key> > keys;
+        foreach (const Key &key, order) {
+            QString connectionName = writing.value(key).connectionName;
+            if (!keys.contains(connectionName))
+                connections.append(connectionName);
+            keys[connectionName].append(key);
+        }
+
+        bool ok = true;
+        foreach (const QString &connectionName, connections) {
+            QSqlDatabase db = m_handler->database(connectionName);
+
+            bool written = db.isOpen() && db.transaction();
+            foreach (const Key &key, keys.value(connectionName)) {
+                if (written)
+                    written = write(db, writing.value(key));
+                // Stats were faked on close(), the write date comes from here
+                key.first->removeStat(key.second);
+            }
+
+            if (!written || !db.commit()) {
+                qWarning("sqlfs: write behind on %s failed: %s",
+                         qPrintable(connectionName),
+                         qPrintable(db.lastError().text()));
+                db.rollback();
+                ok = false;
+            }
+        }
+        return ok;
+    }
+
+    bool write(const QSqlDatabase &db, const SqlFsPendingWrite &pending)
+    {
+        if (pending.truncate) {
+            QSqlQuery &qry = m_handler->query(db, pending.tableName,
+                                              SqlFileEngineHandler::TruncateChunks,
+                                              pending.mount);
+            qry.bindValue(":node", pending.node);
+            qry.bindValue(":idx", pending.truncateIdx);
+            if (!qry.exec())
+                return false;
+        }
+
+        qint64 bytes = 0;
+        QHash<qint64, QByteArray>::const_iterator it;
+        for (it = pending.chunks.constBegin(); it != pending.chunks.constEnd(); ++it) {
+            if (!storeChunk(m_handler, db, pending.mount, pending.tableName, pending.node,
+                            it.key(), it.value(), pending.deduplicate, pending.codec))
+                return false;
+            bytes += it.value().size();
+        }
+
+        if (pending.fullText && !storeText(m_handler, db, pending.mount, pending.tableName,
+                                           pending.node, pending.text))
+            return false;
+
+        QSqlQuery &meta = m_handler->query(db, pending.tableName,
+                                           SqlFileEngineHandler::UpdateMetadata,
+                                           pending.mount);
+        meta.bindValue(":size", pending.size);
+        meta.bindValue(":rowid", pending.node);
+        if (!meta.exec())
+            return false;
+
+        pending.mount->count(SqlFsStatistics::BytesFlushed, bytes);
+        return true;
+    }
+
+    const SqlFileEngineHandler *m_handler;
+    QMutex m_mutex;
+    QWaitCondition m_queued;
+    QWaitCondition m_written;
+    QHash<Key, SqlFsPendingWrite> m_pending;
+    QList<Key> m_order;
+    // Taken from the queue and being committed
+    QHash<Key, SqlFsPendingWrite> m_writing;
+    QStringList m_released;
+    bool m_stop;
+    bool m_failed;
+};
+
+// Request of the asynchronous API, see SqlFs
+class SqlFsRequest
+{
+public:
+    SqlFsRequest(const QString &path) :
+        path(path)
+    {
+    }
+
+    virtual ~SqlFsRequest()
+    {
+    }
+
+    virtual bool isCanceled() const = 0;
+    virtual bool isWrite() const = 0;
+    // Executes the request, the result is reported by finish()
+    virtual bool run() = 0;
+    // ok is false if run() or the transaction around it failed
+    virtual void finish(bool ok) = 0;
+
+    QString path;
+};
+
+template <typename T>
+class SqlFsResultRequest : public SqlFsRequest
+{
+public:
+    SqlFsResultRequest(const QString &path) :
+        SqlFsRequest(path)
+    {
+        m_future.reportStarted();
+    }
+
+    QFuture<T> future()
+    {
+        return m_future.future();
+    }
+
+    bool isCanceled() const
+    {
+        return m_future.isCanceled();
+    }
+
+protected:
+    void report(const T &result)
+    {
+        m_future.reportFinished(&result);
+    }
+
+private:
+    QFutureInterface<T> m_future;
+};
+
+class SqlFsReadRequest : public SqlFsResultRequest<QByteArray>
+{
+public:
+    SqlFsReadRequest(const QString &path) :
+        SqlFsResultRequest<QByteArray>(path)
+    {
+    }
+
+    bool isWrite() const
+    {
+        return false;
+    }
+
+    bool run()
+    {
+        // Opening creates missing files
+        QFile file(path);
+        if (!file.exists() || !file.open(QIODevice::ReadOnly))
+            return false;
+
+        m_data = file.readAll();
+        // Null is reserved for failures
+        if (m_data.isNull())
+            m_data = QByteArray("");
+        return true;
+    }
+
+    void finish(bool ok)
+    {
+        report(ok ? m_data : QByteArray());
+    }
+
+private:
+    QByteArray m_data;
+};
+
+class SqlFsWriteRequest : public SqlFsResultRequest<bool>
+{
+public:
+    SqlFsWriteRequest(const QString &path, const QByteArray &data) :
+        SqlFsResultRequest<bool>(path),
+        m_data(data)
+    {
+    }
+
+    bool isWrite() const
+    {
+        return true;
+    }
+
+    bool run()
+    {
+        QFile file(path);
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+            return false;
+
+        bool ok = file.write(m_data) == m_data.size();
+        file.close();
+        return ok;
+    }
+
+    void finish(bool ok)
+    {
+        report(ok);
+    }
+
+private:
+    QByteArray m_data;
+};
+
+class SqlFsListRequest : public SqlFsResultRequest<QStringList>
+{
+public:
+    SqlFsListRequest(const QString &path, QDir::Filters filters) :
+        SqlFsResultRequest<QStringList>(path),
+        m_filters(filters)
+    {
+    }
+
+    bool isWrite() const
+    {
+        return false;
+    }
+
+    bool run()
+    {
+        QDir dir(path);
+        if (!dir.exists())
+            return false;
+
+        m_list = dir.entryList(m_filters);
+        return true;
+    }
+
+    void finish(bool ok)
+    {
+        report(ok ? m_list : QStringList());
+    }
+
+private:
+    QDir::Filters m_filters;
+    QStringList m_list;
+};
+
+// Host file read by the pool of SqlFsPack
+struct SqlFsPackItem
+{
+    QString path;
+    QByteArray data;
+    bool ok;
+};
+
+// Hands files from the pool to the database thread, readers block while
+// more than maxBytes are waiting
+class SqlFsPackQueue
+{
+public:
+    SqlFsPackQueue(qint64 maxBytes) :
+        m_maxBytes(maxBytes),
+        m_bytes(0)
+    {
+    }
+
+    void put(const SqlFsPackItem &item)
+    {
+        QMutexLocker locker(&m_mutex);
+        while (!m_items.isEmpty() && m_bytes + item.data.size() > m_maxBytes)
+            m_space.wait(&m_mutex);
+        m_items.append(item);
+        m_bytes += item.data.size();
+        m_ready.wakeAll();
+    }
+
+    SqlFsPackItem take()
+    {
+        QMutexLocker locker(&m_mutex);
+        while (m_items.isEmpty())
+            m_ready.wait(&m_mutex);
+        SqlFsPackItem item = m_items.takeFirst();
+        m_bytes -= item.data.size();
+        m_space.wakeAll();
+        return item;
+    }
+
+private:
+    QMutex m_mutex;
+    QWaitCondition m_ready;
+    QWaitCondition m_space;
+    QList<SqlFsPackItem> m_items;
+    qint64 m_maxBytes;
+    qint64 m_bytes;
+};
+
+class SqlFsPackReader : public QRunnable
+{
+public:
+    SqlFsPackReader(SqlFsPackQueue *queue, const QString &fileName, const QString &path) :
+        m_queue(queue),
+        m_fileName(fileName),
+        m_path(path)
+    {
+    }
+
+    void run()
+    {
+        SqlFsPackItem item;
+        item.path = m_path;
+
+        QFile file(m_fileName);
+        item.ok = file.open(QIODevice::ReadOnly);
+        if (item.ok) {
+            item.data = file.readAll();
+            item.ok = item.data.size() == file.size();
+        }
+        m_queue->put(item);
+    }
+
+private:
+    SqlFsPackQueue *m_queue;
+    QString m_fileName;
+    QString m_path;
+};
+
+class SqlFsUnpackWriter : public QRunnable
+{
+public:
+    SqlFsUnpackWriter(const QString &fileName, const QByteArray &data, QAtomicInt *failures) :
+        m_fileName(fileName),
+        m_data(data),
+        m_failures(failures)
+    {
+    }
+
+    void run()
+    {
+        QFile file(m_fileName);
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) ||
+                file.write(m_data) != m_data.size() || !file.flush())
+            m_failures->ref();
+    }
+
+private:
+    QString m_fileName;
+    QByteArray m_data;
+    QAtomicInt *m_failures;
+};
+
+// Frees pages after deletions without making them wait for it
+class SqlFsVacuumRequest : public SqlFsRequest
+{
+public:
+    SqlFsVacuumRequest(const SqlFileEngineHandler *handler,
+                       const QString &connectionName, int pages) :
+        SqlFsRequest("sql:/" + connectionName),
+        m_handler(handler),
+        m_connectionName(connectionName),
+        m_pages(pages)
+    {
+    }
+
+    bool isCanceled() const
+    {
+        return false;
+    }
+
+    bool isWrite() const
+    {
+        return true;
+    }
+
+    bool run()
+    {
+        {
+            QMutexLocker locker(&m_handler->m_mutex);
+            m_handler->m_vacuums.remove(m_connectionName);
+        }
+
+        bool ok = m_handler->vacuum(m_connectionName, m_pages);
+        if (!ok)
+            qWarning("sqlfs: incremental vacuum of %s failed", qPrintable(m_connectionName));
+        return ok;
+    }
+
+    void finish(bool ok)
+    {
+        // Nobody waits for it, the next deletion schedules another one
+        Q_UNUSED(ok);
+    }
+
+private:
+    const SqlFileEngineHandler *m_handler;
+    QString m_connectionName;
+    int m_pages;
+};
+
+/*
+ * Database thread of the asynchronous API. Everything queued while a
+ * previous round was running is executed in one round, with one batch per
+ * connection. Requests still queued on destruction are canceled.
+ */
+class SqlFsAsync : public QThread
+{
+public:
+    SqlFsAsync(const SqlFileEngineHandler *handler) :
+        m_handler(handler),
+        m_stop(false)
+    {
+    }
+
+    ~SqlFsAsync()
+    {
+        {
+            QMutexLocker locker(&m_mutex);
+            m_stop = true;
+            m_queued.wakeAll();
+        }
+        wait();
+
+        foreach (SqlFsRequest *request, m_queue) {
+            request->finish(false);
+            delete request;
+        }
+    }
+
+    void submit(SqlFsRequest *request)
+    {
+        QMutexLocker locker(&m_mutex);
+        m_queue.append(request);
+        m_queued.wakeAll();
+    }
+
+    // Drops the thread's clone of a connection after the current round
+    void release(const QString &connectionName)
+    {
+        QMutexLocker locker(&m_mutex);
+        m_released.append(connectionName);
+        m_queued.wakeAll();
+        while (m_released.contains(connectionName))
+            m_done.wait(&m_mutex);
+    }
+
+protected:
+    void run()
+    {
+        QMutexLocker locker(&m_mutex);
+        forever {
+            while (m_queue.isEmpty() && m_released.isEmpty() && !m_stop)
+                m_queued.wait(&m_mutex);
+
+            if (m_stop)
+                break;
+
+            QList<SqlFsRequest *> requests = m_queue;
+            QStringList released = m_released;
+            m_queue.clear();
+
+            locker.unlock();
+            process(requests);
+            foreach (const QString &connectionName, released)
+                m_handler->releaseThreadConnection(connectionName);
+            locker.relock();
+
+            m_released = m_released.mid(released.size());
+            m_done.wakeAll();
+        }
+
+        // Clones must not outlive release() calls made during shutdown
+        foreach (const QString &connectionName, m_released)
+            m_handler->releaseThreadConnection(connectionName);
+        m_released.clear();
+        m_done.wakeAll();
+    }
+
+private:
+    void process(const QList<SqlFsRequest *> &requests)
+    {
+        QStringList connections;
+        QHash<QString, QList<SqlFsRequest *> > groups;
+        foreach (SqlFsRequest *request, requests) {
+            if (request->isCanceled()) {
+                request->finish(false);
+                delete request;
+                continue;
+            }
+
+            QString connectionName = request->path.section('/', 1, 1);
+            if (!groups.contains(connectionName))
+                connections.append(connectionName);
+            groups[connectionName].append(request);
+        }
+
+        foreach (const QString &connectionName, connections) {
+            const QList<SqlFsRequest *> &group = groups[connectionName];
+
+            SqlFsBatch batch(m_handler, "sql:/" + connectionName);
+            QList<bool> results;
+            foreach (SqlFsRequest *request, group)
+                results.append(!request->isCanceled() && request->run());
+            // Without a batch every write has been committed on its own
+            bool committed = !batch.isActive() || batch.commit();
+
+            for (int i = 0; i < group.size(); i++) {
+                group.at(i)->finish(results.at(i) &&
+                                    (committed || !group.at(i)->isWrite()));
+                delete group.at(i);
+            }
+        }
+    }
+
+    const SqlFileEngineHandler *m_handler;
+    QMutex m_mutex;
+    QWaitCondition m_queued;
+    QWaitCondition m_done;
+    QList<SqlFsRequest *> m_queue;
+    QStringList m_released;
+    bool m_stop;
+};
+
+class SqlFileEngineIterator : public QAbstractFileEngineIterator
+{
+public:
+    SqlFileEngineIterator(SqlFileEngine *engine, QDir::Filters filters,
+                          const QStringList &nameFilters) :
+        QAbstractFileEngineIterator(filters, nameFilters),
+        m_index(-1)
+    {
+        SqlFsTimer timer(engine->m_mount, SqlFsStatistics::List);
+
+        // Indexed mounts know all entries already
+        if (engine->m_mount->children(engine->m_nodeId, &m_list))
+            return;
+
+        // Entries are usually stat'ed right after listing, so their nodes
+        // and metadata are cached on the way.
+        engine->m_handler->waitForWrites(engine->m_mount);
+        QSqlQuery &qry = engine->query(SqlFileEngineHandler::SelectChildren);
+        qry.bindValue(":parent", engine->m_nodeId);
+        qry.exec();
+
+        while (qry.next()) {
+            QString name = qry.value(0).toString();
+            int node = qry.value(1).toInt();
+            engine->m_mount->insert(engine->m_nodeId, name, node);
+            engine->m_mount->insertStat(node, SqlFsStat(qry, 2));
+            m_list.append(name);
+        }
+        qry.finish();
+    }
+
+    bool hasNext() const
+    {
+        return m_index < m_list.size() - 1;
+    }
+
+    QString next()
+    {
+        if (!hasNext())
+            return QString();
+
+        m_index++;
+        return currentFilePath();
+    }
+
+    QString currentFileName() const
+    {
+        return m_list.at(m_index);
+    }
+
+private:
+    QStringList m_list;
+    int m_index;
+
+};
+
+const qint64 SqlFileEngine::ChunkSize;
+const int SqlFileEngine::MaxCachedChunks;
+const int SqlFileEngine::ChunkRowWindow;
+const int SqlFileEngine::SchemaVersion;
+const qint64 SqlFileEngine::MaxSharedMapping;
+const qint64 SqlFileEngine::MaxIndexedFile;
+
+const int SqlFsMount::MaxCachedNodes;
+const int SqlFsMount::MaxCachedStats;
+
+const int SqlFsWatcher::DefaultInterval;
+
+const int SqlFsBatch::DefaultMaxOps;
+const qint64 SqlFsBatch::DefaultMaxBytes;
+
+SqlFileEngineHandler *SqlFileEngineHandler::s_instance = 0;
+
+SqlFileEngineHandler::SqlFileEngineHandler() :
+    m_writer(0),
+    m_async(0)
+{
+    if (!s_instance)
+        s_instance = this;
+
+    registerCodec(new SqlFsZlibCodec);
+}
+
+SqlFileEngineHandler *SqlFileEngineHandler::instance()
+{
+    return s_instance;
+}
+
+void SqlFileEngineHandler::registerCodec(SqlFsCodec *codec)
+{
+    m_codecs.append(codec);
+}
+
+const SqlFsCodec *SqlFileEngineHandler::codec(int id) const
+{
+    foreach (const SqlFsCodec *codec, m_codecs) {
+        if (codec->id() == id)
+            return codec;
+    }
+    return 0;
+}
+
+const SqlFsCodec *SqlFileEngineHandler::codec(const QString &name) const
+{
+    foreach (const SqlFsCodec *codec, m_codecs) {
+        if (codec->name() == name)
+            return codec;
+    }
+    return 0;
+}
+
+SqlFileEngineHandler::~SqlFileEngineHandler()
+{
+    if (s_instance == this)
+        s_instance = 0;
+
+    // Cancels pending requests, then drains the write-behind queue
+    delete m_async;
+    delete m_writer;
+    qDeleteAll(m_codecs);
+
+    // Statements of other threads are released when they exit
+    if (m_threadConnections.hasLocalData())
+        m_threadConnections.localData()->releaseStatements();
+
+    foreach (SqlFsMount *mount, m_mounts)
+        qCDebug(lcSqlFs, "%s: %s", qPrintable(mount->name()),
+                qPrintable(mount->statistics().toString()));
+    qDeleteAll(m_mounts);
+    qDeleteAll(m_batches);
+}
+
+QAbstractFileEngine *SqlFileEngineHandler::create(const QString &fileName) const
+{
+    // Qt asks every handler about every file name the application uses
+    if (!fileName.startsWith(QLatin1String("sql:/")))
+        return NULL;
+
+    // sql:/<connection>/<table>, neither of them empty
+    int slash = fileName.indexOf('/', 5);
+    if (slash <= 5 || slash + 1 >= fileName.size() || fileName.at(slash + 1) == '/')
+        return NULL;
+
+    return new SqlFileEngine(stripOptions(fileName), this);
+}
+
+bool SqlFileEngineHandler::addMount(const QString &connectionName,
+                                    const QString &tableName,
+                                    const SqlFsMountOptions &options) const
+{
+    QSqlDatabase db = database(connectionName);
+    if (!db.isOpen() || tableName.isEmpty() || tableName.contains('/')) {
+        qWarning("sqlfs: cannot mount %s/%s", qPrintable(connectionName),
+                 qPrintable(tableName));
+        return false;
+    }
+
+    setMountOptions(connectionName, tableName, options);
+    if (!SqlFileEngine::createTable(this, tableName, db))
+        return false;
+
+    // Engines of preloading mounts load the index
+    if (options.preload)
+        SqlFileEngine root("sql:/" + connectionName + '/' + tableName, this);
+    return true;
+}
+
+QSqlDatabase SqlFileEngineHandler::database(const QString &connectionName) const
+{
+    if (!QSqlDatabase::contains(connectionName))
+        return QSqlDatabase();
+
+    SqlFsThreadConnections *connections = threadConnections();
+    QString name = connections->names.value(connectionName);
+    if (name.isEmpty()) {
+        QSqlDatabase db = QSqlDatabase::database(connectionName, false);
+        if (db.isValid() && db.driver()->thread() == QThread::currentThread())
+            name = connectionName;
+        else
+            name = cloneConnection(connectionName);
+        connections->names.insert(connectionName, name);
+    }
+
+    return QSqlDatabase::database(name);
+}
+
+SqlFsThreadConnections *SqlFileEngineHandler::threadConnections() const
+{
+    SqlFsThreadConnections *connections = m_threadConnections.localData();
+    if (!connections) {
+        connections = new SqlFsThreadConnections(this);
+        m_threadConnections.setLocalData(connections);
+    }
+    return connections;
+}
+
+QString SqlFileEngineHandler::cloneConnection(const QString &connectionName) const
+{
+    QString name = QString("%1@sqlfs-%2").arg(connectionName)
+            .arg(reinterpret_cast<quintptr>(QThread::currentThread()), 0, 16);
+
+#if QT_VERSION >= QT_VERSION_CHECK(5, 13, 0)
+    QSqlDatabase db = QSqlDatabase::cloneDatabase(connectionName, name);
+#else
+    QSqlDatabase db = QSqlDatabase::cloneDatabase(
+                QSqlDatabase::database(connectionName, false), name);
+#endif
+
+    if (privateDatabase(db))
+        qWarning("sqlfs: in memory database %s is not shared with other threads",
+                 qPrintable(connectionName));
+
+    if (!db.open())
+        qWarning("sqlfs: failed to open %s", qPrintable(name));
+
+    QList<SqlFsMountOptions> options;
+    {
+        QString prefix = connectionName + '/';
+        QMutexLocker locker(&m_mutex);
+        m_clones.insert(name, connectionName);
+
+        QHash<QString, SqlFsMount *>::const_iterator it;
+        for (it = m_mounts.constBegin(); it != m_mounts.constEnd(); ++it) {
+            if (it.key().startsWith(prefix))
+                options.append(it.value()->options());
+        }
+    }
+
+    foreach (const SqlFsMountOptions &mountOptions, options)
+        applyPragmas(db, mountOptions);
+
+    return name;
+}
+
+void SqlFileEngineHandler::releaseClone(const QString &cloneName) const
+{
+    releaseStatements(cloneName);
+    {
+        QString prefix = cloneName + '/';
+        QMutexLocker locker(&m_mutex);
+        m_clones.remove(cloneName);
+
+        QMutableHashIterator<QString, int> subscriptions(m_subscriptions);
+        while (subscriptions.hasNext()) {
+            if (subscriptions.next().key().startsWith(prefix))
+                subscriptions.remove();
+        }
+    }
+    {
+        QSqlDatabase db = QSqlDatabase::database(cloneName, false);
+        db.close();
+    }
+    QSqlDatabase::removeDatabase(cloneName);
+}
+
+void SqlFileEngineHandler::releaseThreadConnection(const QString &connectionName) const
+{
+    SqlFsThreadConnections *connections = m_threadConnections.localData();
+    if (!connections)
+        return;
+
+    QString name = connections->names.take(connectionName);
+    if (!name.isEmpty() && name != connectionName)
+        releaseClone(name);
+}
+
+SqlFsMount *SqlFileEngineHandler::mount(const QString &connectionName,
+                                        const QString &tableName) const
+{
+    QMutexLocker locker(&m_mutex);
+
+    // Clones share the mounts of their original connection
+    QString key = m_clones.value(connectionName, connectionName) + '/' + tableName;
+    SqlFsMount *mount = m_mounts.value(key);
+    if (!mount) {
+        mount = new SqlFsMount(key, tableName);
+        m_mounts.insert(key, mount);
+    }
+    return mount;
+}
+
+SqlFsMountOptions SqlFileEngineHandler::mountOptions(const QString &connectionName,
+                                                     const QString &tableName) const
+{
+    return mount(connectionName, tableName)->options();
+}
+
+void SqlFileEngineHandler::setMountOptions(const QString &connectionName,
+                                           const QString &tableName,
+                                           const SqlFsMountOptions &options) const
+{
+    SqlFsMount *fsMount = mount(connectionName, tableName);
+    QSqlDatabase db = database(connectionName);
+
+    // The writer thread would write queued contents to a database nobody
+    // else sees
+    SqlFsMountOptions applied = options;
+    if (applied.writeBehind && privateDatabase(db)) {
+        qWarning("sqlfs: write behind needs a database file, %s/%s writes through",
+                 qPrintable(connectionName), qPrintable(tableName));
+        applied.writeBehind = false;
+    }
+
+    if (fsMount->options() == applied)
+        return;
+
+    fsMount->setOptions(applied);
+    applyPragmas(db, applied);
+
+    // Mounts without FTS5 are not indexed rather than failing every store
+    if (applied.fullText && !createFullText(connectionName, tableName)) {
+        applied.fullText = false;
+        fsMount->setOptions(applied);
+    }
+}
+
+QString SqlFileEngineHandler::stripOptions(const QString &fileName) const
+{
+    // Options belong to the table, sql:/<connection>/<table>?<options>,
+    // question marks anywhere else are part of a name
+    int tableBegin = fileName.indexOf('/', 5) + 1;
+    if (!fileName.startsWith(QLatin1String("sql:/")) || tableBegin <= 0)
+        return fileName;
+
+    int tableEnd = fileName.indexOf('/', tableBegin);
+    if (tableEnd < 0)
+        tableEnd = fileName.size();
+
+    int begin = fileName.indexOf('?', tableBegin);
+    if (begin < 0 || begin >= tableEnd)
+        return fileName;
+
+    QString connectionName = fileName.mid(5, tableBegin - 6);
+    QString tableName = fileName.mid(tableBegin, begin - tableBegin);
+    if (tableName.isEmpty()) {
+        qWarning("sqlfs: mount options have to follow the table name in %s",
+                 qPrintable(fileName));
+    } else {
+        SqlFsMountOptions options = mountOptions(connectionName, tableName);
+        options.parse(fileName.mid(begin + 1, tableEnd - begin - 1));
+        setMountOptions(connectionName, tableName, options);
+    }
+
+    return fileName.left(begin) + fileName.mid(tableEnd);
+}
+
+// Subtree below :node as table tree(id), %1 is its node table
+static QString subtreeSql()
+{
+    return "WITH RECURSIVE tree(id) AS ("
+           "SELECT :node "
+           "UNION ALL "
+           "SELECT n.rowid FROM %1 n JOIN tree ON n.parent=tree.id) ";
+}
+
+static QString statementSql(SqlFileEngineHandler::Statement statement)
+{
+    // %1 is the node table, %2 the chunk table, %3 the chunk size and %4
+    // the blob table
+    switch (statement) {
+    case SqlFileEngineHandler::SelectStat:
+        return "SELECT flags, COALESCE(size, 0), create_date, write_date "
+               "FROM %1 WHERE rowid=:rowid";
+    case SqlFileEngineHandler::SelectMetadata:
+        // The size of a chunked file is given by its last chunk. Files
+        // written before chunk tables existed keep their content in the
+        // data column. The size column only serves stat calls.
+        return "SELECT length(n.data), "
+               "(SELECT c.idx * %3 + COALESCE(c.length, length(COALESCE(c.data, b.data))) "
+               "FROM %2 c "
+               "LEFT JOIN %4 b ON b.rowid=c.blob "
+               "WHERE c.node=n.rowid ORDER BY c.idx DESC LIMIT 1) "
+               "FROM %1 n WHERE n.rowid=:rowid";
+    case SqlFileEngineHandler::SelectRoot:
+        return "SELECT rowid FROM %1 WHERE parent IS NULL AND name=:name";
+    case SqlFileEngineHandler::SelectChild:
+        return "SELECT rowid FROM %1 WHERE parent=:parent AND name=:name";
+    case SqlFileEngineHandler::SelectPath:
+        // Resolves a '/' terminated path below :parent, one row per
+        // component. The node of a missing component is NULL.
+        return "WITH RECURSIVE walk(depth, node, rest) AS ("
+               "SELECT 0, :parent, :path "
+               "UNION ALL "
+               "SELECT depth + 1, "
+               "(SELECT rowid FROM %1 WHERE parent=walk.node "
+               "AND name=substr(walk.rest, 1, instr(walk.rest, '/') - 1)), "
+               "substr(walk.rest, instr(walk.rest, '/') + 1) "
+               "FROM walk WHERE walk.node IS NOT NULL AND walk.rest <> '') "
+               "SELECT depth, node FROM walk WHERE depth > 0 ORDER BY depth";
+    case SqlFileEngineHandler::SelectChildren:
+        return "SELECT name, rowid, flags, COALESCE(size, 0), create_date, write_date "
+               "FROM %1 WHERE parent=:parent";
+    case SqlFileEngineHandler::CountChildren:
+        return "SELECT COUNT(*) FROM %1 WHERE parent=:parent";
+    case SqlFileEngineHandler::SelectChunk:
+        return "SELECT COALESCE(c.data, b.data), c.encoding FROM %2 c "
+               "LEFT JOIN %4 b ON b.rowid=c.blob "
+               "WHERE c.node=:node AND c.idx=:idx";
+    case SqlFileEngineHandler::SelectLegacyChunk:
+        return "SELECT substr(data, :offset, :length) FROM %1 WHERE rowid=:rowid";
+    case SqlFileEngineHandler::SelectChunkRows:
+        return "SELECT idx, rowid, COALESCE(blob, -1), encoding IS NOT NULL FROM %2 "
+               "WHERE node=:node AND idx BETWEEN :first AND :last";
+    case SqlFileEngineHandler::InsertNode:
+        return "INSERT INTO %1 (create_date, parent, name, flags) "
+               "VALUES (CURRENT_TIMESTAMP, :parent, :name, :flags)";
+    case SqlFileEngineHandler::MoveNode:
+        return "UPDATE %1 SET parent=:parent, name=:name WHERE rowid=:rowid";
+    case SqlFileEngineHandler::UpdateMetadata:
+        return "UPDATE %1 SET write_date=CURRENT_TIMESTAMP, size=:size "
+               "WHERE rowid=:rowid";
+    case SqlFileEngineHandler::ClearData:
+        return "UPDATE %1 SET data=NULL WHERE rowid=:rowid";
+    case SqlFileEngineHandler::DeleteNode:
+        return "DELETE FROM %1 WHERE rowid=:rowid";
+    case SqlFileEngineHandler::ReplaceChunk:
+        return "INSERT OR REPLACE INTO %2 (node, idx, data, encoding, length) "
+               "VALUES (:node, :idx, :data, :encoding, :length)";
+    case SqlFileEngineHandler::UpdateChunk:
+        return "UPDATE %2 SET data=:data, blob=NULL, encoding=:encoding, length=:length "
+               "WHERE node=:node AND idx=:idx";
+    case SqlFileEngineHandler::InsertBlob:
+        return "INSERT OR IGNORE INTO %4 (hash, data) VALUES (:hash, :data)";
+    case SqlFileEngineHandler::UpdateChunkBlob:
+        return "UPDATE %2 SET data=NULL, "
+               "blob=(SELECT rowid FROM %4 WHERE hash=:hash), "
+               "encoding=:encoding, length=:length "
+               "WHERE node=:node AND idx=:idx";
+    case SqlFileEngineHandler::InsertChunkBlob:
+        return "INSERT INTO %2 (node, idx, encoding, length, blob) "
+               "SELECT :node, :idx, :encoding, :length, rowid FROM %4 WHERE hash=:hash";
+    case SqlFileEngineHandler::DeleteChunks:
+        return "DELETE FROM %2 WHERE node=:node";
+    case SqlFileEngineHandler::TruncateChunks:
+        return "DELETE FROM %2 WHERE node=:node AND idx>:idx";
+    case SqlFileEngineHandler::ConvertLegacy:
+        // Splits the data column into chunks inside the database, the
+        // content never passes through this process.
+        return "WITH RECURSIVE seq(i, node, content) AS ("
+               "SELECT 0, rowid, data FROM %1 "
+               "WHERE rowid=:rowid AND length(data) > 0 "
+               "UNION ALL "
+               "SELECT i + 1, node, content FROM seq "
+               "WHERE (i + 1) * %3 < length(content)) "
+               "INSERT OR REPLACE INTO %2 (node, idx, data) "
+               "SELECT node, i, substr(content, i * %3 + 1, %3) FROM seq";
+    case SqlFileEngineHandler::DeleteTreeChunks:
+        return subtreeSql() + "DELETE FROM %2 WHERE node IN tree";
+    case SqlFileEngineHandler::DeleteTree:
+        return subtreeSql() + "DELETE FROM %1 WHERE rowid IN tree";
+    case SqlFileEngineHandler::SweepNodes:
+        return "WITH RECURSIVE live(id) AS ("
+               "SELECT rowid FROM %1 WHERE parent IS NULL "
+               "UNION ALL "
+               "SELECT n.rowid FROM %1 n JOIN live ON n.parent=live.id) "
+               "DELETE FROM %1 WHERE rowid NOT IN live";
+    case SqlFileEngineHandler::SweepChunks:
+        return "DELETE FROM %2 WHERE node NOT IN (SELECT rowid FROM %1)";
+    case SqlFileEngineHandler::CountBlobRefs:
+        return "UPDATE %4 SET refs=(SELECT COUNT(*) FROM %2 WHERE blob=%4.rowid)";
+    case SqlFileEngineHandler::SweepBlobs:
+        return "DELETE FROM %4 WHERE refs<=0";
+    case SqlFileEngineHandler::SelectTree:
+        // Parents are listed before their children, paths start with '/'
+        return "WITH RECURSIVE tree(id, path) AS ("
+               "SELECT rowid, '' FROM %1 WHERE rowid=:node "
+               "UNION ALL "
+               "SELECT n.rowid, tree.path || '/' || n.name "
+               "FROM %1 n JOIN tree ON n.parent=tree.id) "
+               "SELECT t.path, n.flags, COALESCE(n.size, 0) FROM tree t "
+               "JOIN %1 n ON n.rowid=t.id WHERE t.id<>:root";
+    case SqlFileEngineHandler::SelectDataVersion:
+        return "PRAGMA data_version";
+    case SqlFileEngineHandler::SelectIndex:
+        return "SELECT rowid, parent, name, flags, COALESCE(size, 0), create_date, write_date "
+               "FROM %1";
+    case SqlFileEngineHandler::SelectChanges:
+        return "SELECT changes FROM sqlfs_meta WHERE name=:name";
+    case SqlFileEngineHandler::DeleteText:
+        return "DELETE FROM %5 WHERE rowid=:node";
+    case SqlFileEngineHandler::InsertText:
+        return "INSERT INTO %5 (rowid, content) VALUES (:node, :content)";
+    case SqlFileEngineHandler::DeleteTreeText:
+        return subtreeSql() + "DELETE FROM %5 WHERE rowid IN tree";
+    case SqlFileEngineHandler::SearchText:
+        // Paths are built upwards from every match until :node, matches
+        // outside of it never get there
+        return "WITH RECURSIVE matches(node, snippet, score) AS ("
+               "SELECT rowid, snippet(%5, 0, '[', ']', '...', 16), rank FROM %5 "
+               "WHERE %5 MATCH :query), "
+               "up(node, id, path) AS ("
+               "SELECT node, node, '' FROM matches "
+               "UNION ALL "
+               "SELECT up.node, n.parent, '/' || n.name || up.path "
+               "FROM up JOIN %1 n ON n.rowid=up.id "
+               "WHERE up.id<>:node AND n.parent IS NOT NULL) "
+               "SELECT up.path, m.snippet FROM up JOIN matches m ON m.node=up.node "
+               "WHERE up.id=:root ORDER BY m.score LIMIT :limit";
+    case SqlFileEngineHandler::StatementCount:
+        break;
+    }
+
+    return QString();
+}
+
+// Statements on the subtree below :node. %1 to %3 are the node, chunk and
+// blob table of the source, %4 to %6 those of the destination.
+static QString treeSql(const QString &statement, const QString &tableName,
+                       const QString &destTable)
+{
+    QString sql = subtreeSql() + statement;
+
+    return sql.replace("%1", tableName)
+            .replace("%2", SqlFileEngine::chunkTableName(tableName))
+            .replace("%3", SqlFileEngine::blobTableName(tableName))
+            .replace("%4", destTable)
+            .replace("%5", SqlFileEngine::chunkTableName(destTable))
+            .replace("%6", SqlFileEngine::blobTableName(destTable));
+}
+
+QSqlQuery &SqlFileEngineHandler::query(const QSqlDatabase &db,
+                                       const QString &tableName,
+                                       Statement statement,
+                                       SqlFsMount *mount) const
+{
+    // Connections only work in their thread, so do their statements. The
+    // cache is kept with the thread's connections and needs no lock.
+    SqlFsThreadConnections *connections = threadConnections();
+    QVector<QSqlQuery *> &statements = connections->statements[db.connectionName()][tableName];
+    if (statements.isEmpty())
+        statements.fill(0, StatementCount);
+
+    // Prepare again after errors or if the connection was replaced
+    QSqlQuery *&qry = statements[statement];
+    if (qry && (qry->lastError().isValid() || qry->driver() != db.driver())) {
+        connections->deleteQuery(qry);
+        qry = 0;
+    }
+
+    if (!qry) {
+        qry = new QSqlQuery(db);
+        qry->setForwardOnly(true);
+        qry->prepare(statementSql(statement)
+                     .replace("%1", tableName)
+                     .replace("%2", SqlFileEngine::chunkTableName(tableName))
+                     .replace("%3", QString::number(SqlFileEngine::ChunkSize))
+                     .replace("%4", SqlFileEngine::blobTableName(tableName))
+                     .replace("%5", SqlFileEngine::textTableName(tableName)));
+
+        // The trace hook costs nothing unless the category is enabled
+        if (lcSqlFsQuery().isDebugEnabled())
+            connections->trace(db, qry, tableName);
+    }
+
+    // Callers fetch statements for every execution
+    if (mount)
+        mount->countStatement(statement);
+    return *qry;
+}
+
+void SqlFileEngineHandler::releaseStatements(const QString &connectionName) const
+{
+    // Other threads only use clones, which they release themselves
+    if (m_threadConnections.hasLocalData())
+        m_threadConnections.localData()->releaseStatements(connectionName);
+}
+
+void SqlFileEngineHandler::releaseConnection(const QString &connectionName)
+{
+    SqlFsWriter *writer;
+    SqlFsAsync *async;
+    {
+        QMutexLocker locker(&m_mutex);
+        writer = m_writer;
+        async = m_async;
+    }
+    if (async)
+        async->release(connectionName);
+    if (writer)
+        writer->release(connectionName);
+
+    releaseStatements(connectionName);
+
+    QString prefix = connectionName + '/';
+
+    QMutexLocker locker(&m_mutex);
+    QMutableHashIterator<QString, SqlFsMount *> mounts(m_mounts);
+    while (mounts.hasNext()) {
+        mounts.next();
+        if (mounts.key().startsWith(prefix)) {
+            delete mounts.value();
+            mounts.remove();
+        }
+    }
+
+    QMutableHashIterator<QString, int> subscriptions(m_subscriptions);
+    while (subscriptions.hasNext()) {
+        if (subscriptions.next().key().startsWith(prefix))
+            subscriptions.remove();
+    }
+}
+
+bool SqlFileEngineHandler::beginBatch(const QString &connectionName,
+                                      int maxOps, qint64 maxBytes) const
+{
+    // Batches belong to the connection of the calling thread
+    QSqlDatabase db = database(connectionName);
+
+    QMutexLocker locker(&m_mutex);
+    SqlFsBatchState *batch = m_batches.value(db.connectionName());
+    if (batch) {
+        batch->depth++;
+        return true;
+    }
+
+    if (!db.isOpen() || !db.transaction())
+        return false;
+
+    batch = new SqlFsBatchState;
+    batch->db = db;
+    batch->depth = 1;
+    batch->maxOps = maxOps;
+    batch->maxBytes = maxBytes;
+    batch->ops = 0;
+    batch->bytes = 0;
+    batch->failed = false;
+    m_batches.insert(db.connectionName(), batch);
+    return true;
+}
+
+bool SqlFileEngineHandler::endBatch(const QString &connectionName, bool commit) const
+{
+    QString name = database(connectionName).connectionName();
+
+    QMutexLocker locker(&m_mutex);
+    SqlFsBatchState *batch = m_batches.value(name);
+    if (!batch)
+        return false;
+
+    if (!commit)
+        batch->failed = true;
+
+    if (--batch->depth > 0)
+        return !batch->failed;
+
+    m_batches.remove(name);
+
+    bool ok = !batch->failed && batch->db.commit();
+    if (!ok) {
+        batch->db.rollback();
+
+        // Cached nodes and stats may refer to rows which are gone now
+        QString prefix = connectionName + '/';
+        QHash<QString, SqlFsMount *>::const_iterator it;
+        for (it = m_mounts.constBegin(); it != m_mounts.constEnd(); ++it) {
+            if (it.key().startsWith(prefix))
+                it.value()->clear();
+        }
+    }
+
+    delete batch;
+    return ok;
+}
+
+void SqlFileEngineHandler::batchStep(const QSqlDatabase &db, bool ok,
+                                     qint64 bytes) const
+{
+    SqlFsBatchState *batch;
+    {
+        QMutexLocker locker(&m_mutex);
+        batch = m_batches.value(db.connectionName());
+    }
+    // Only the thread owning the connection touches its batch
+    if (!batch || batch->failed)
+        return;
+
+    if (!ok) {
+        batch->failed = true;
+        return;
+    }
+
+    batch->ops++;
+    batch->bytes += bytes;
+    if (batch->ops < batch->maxOps && batch->bytes < batch->maxBytes)
+        return;
+
+    batch->ops = 0;
+    batch->bytes = 0;
+    if (!batch->db.commit() || !batch->db.transaction())
+        batch->failed = true;
+}
+
+bool SqlFileEngineHandler::sync() const
+{
+    SqlFsWriter *writer;
+    {
+        QMutexLocker locker(&m_mutex);
+        writer = m_writer;
+    }
+    return writer ? writer->sync() : true;
+}
+
+void SqlFileEngineHandler::writeBehind(const SqlFsPendingWrite &write) const
+{
+    QMutexLocker locker(&m_mutex);
+    if (!m_writer) {
+        m_writer = new SqlFsWriter(this);
+        m_writer->start();
+    }
+    m_writer->enqueue(write);
+}
+
+void SqlFileEngineHandler::waitForWrites(SqlFsMount *mount, int node) const
+{
+    SqlFsWriter *writer;
+    {
+        QMutexLocker locker(&m_mutex);
+        writer = m_writer;
+    }
+    if (writer)
+        writer->waitFor(mount, node);
+}
+
+void SqlFileEngineHandler::submit(SqlFsRequest *request) const
+{
+    QMutexLocker locker(&m_mutex);
+    if (!m_async) {
+        m_async = new SqlFsAsync(this);
+        m_async->start();
+    }
+    m_async->submit(request);
+}
+
+bool SqlFileEngineHandler::sweep(const QString &connectionName,
+                                 const QString &tableName) const
+{
+    QSqlDatabase db = database(connectionName);
+    if (!db.isValid())
+        return false;
+
+    SqlFsMount *fsMount = mount(connectionName, tableName);
+    waitForWrites(fsMount);
+
+    // Nodes first, their chunks drop blob references through the triggers
+    static const Statement statements[] = {SweepNodes, SweepChunks, CountBlobRefs, SweepBlobs};
+
+    SqlTransaction transaction(db);
+    bool ok = true;
+    for (uint i = 0; ok && i < sizeof(statements) / sizeof(statements[0]); i++)
+        ok = query(db, tableName, statements[i], fsMount).exec();
+    ok = ok && transaction.commit();
+    batchStep(db, ok);
+
+    fsMount->clear();
+    if (ok)
+        scheduleVacuum(connectionName, tableName);
+    return ok;
+}
+
+bool SqlFileEngineHandler::vacuum(const QString &connectionName, int pages) const
+{
+    QSqlDatabase db = database(connectionName);
+    sqlite3 *handle = sqliteHandle(db);
+    if (!handle)
+        return false;
+
+    if (pages < 0) {
+        QSqlQuery qry(db);
+        return qry.exec("VACUUM");
+    }
+
+    // The pragma frees one page per step, sqlite3_exec() steps to the end
+    QByteArray sql = "PRAGMA incremental_vacuum(" + QByteArray::number(pages) + ")";
+    return sqlite3_exec(handle, sql.constData(), 0, 0, 0) == SQLITE_OK;
+}
+
+void SqlFileEngineHandler::scheduleVacuum(const QString &connectionName,
+                                          const QString &tableName) const
+{
+    SqlFsMountOptions options = mountOptions(connectionName, tableName);
+    if (options.autoVacuum != "INCREMENTAL")
+        return;
+
+    QString name;
+    {
+        QMutexLocker locker(&m_mutex);
+        name = m_clones.value(connectionName, connectionName);
+        if (m_vacuums.contains(name))
+            return;
+        m_vacuums.insert(name);
+    }
+    submit(new SqlFsVacuumRequest(this, name, options.vacuumPages));
+}
+
+SqlFsStatistics SqlFileEngineHandler::statistics(const QString &connectionName,
+                                                 const QString &tableName) const
+{
+    return mount(connectionName, tableName)->statistics();
+}
+
+void SqlFileEngineHandler::resetStatistics(const QString &connectionName,
+                                           const QString &tableName) const
+{
+    mount(connectionName, tableName)->resetStatistics();
+}
+
+QList<SqlFsMatch> SqlFileEngineHandler::search(const QString &path,
+                                               const QString &expression,
+                                               int limit) const
+{
+    QList<SqlFsMatch> matches;
+    QScopedPointer<QAbstractFileEngine> engine(create(QDir::fromNativeSeparators(path)));
+    SqlFileEngine *root = static_cast<SqlFileEngine *>(engine.data());
+    if (!root || root->m_nodeId < 0 || !root->m_mount->indexesText()) {
+        qWarning("sqlfs: %s is not indexed", qPrintable(path));
+        return matches;
+    }
+
+    // Queued contents are indexed when they are written
+    waitForWrites(root->m_mount);
+
+    QSqlQuery &qry = query(root->m_db, root->m_tableName, SearchText, root->m_mount);
+    qry.bindValue(":query", expression);
+    qry.bindValue(":node", root->m_nodeId);
+    qry.bindValue(":root", root->m_nodeId);
+    qry.bindValue(":limit", limit);
+    if (!qry.exec()) {
+        qWarning("sqlfs: search for %s failed: %s", qPrintable(expression),
+                 qPrintable(qry.lastError().text()));
+        return matches;
+    }
+
+    QString prefix = root->m_absoluteFileName;
+    if (prefix.endsWith('/'))
+        prefix.chop(1);
+    while (qry.next()) {
+        SqlFsMatch match;
+        match.path = prefix + qry.value(0).toString();
+        match.snippet = qry.value(1).toString();
+        matches.append(match);
+    }
+    qry.finish();
+    return matches;
+}
+
+bool SqlFileEngineHandler::subscribe(const QString &connectionName,
+                                     const QString &tableName) const
+{
+    QSqlDatabase db = database(connectionName);
+    if (!db.isOpen() || !db.driver()->hasFeature(QSqlDriver::EventNotifications))
+        return false;
+
+    QString key = db.connectionName() + '/' + tableName;
+    QMutexLocker locker(&m_mutex);
+    int count = m_subscriptions.value(key);
+    if (count == 0 && !db.driver()->subscribeToNotification(tableName))
+        return false;
+    m_subscriptions.insert(key, count + 1);
+    return true;
+}
+
+void SqlFileEngineHandler::unsubscribe(const QString &connectionName,
+                                       const QString &tableName) const
+{
+    QSqlDatabase db = database(connectionName);
+    QString key = db.connectionName() + '/' + tableName;
+
+    QMutexLocker locker(&m_mutex);
+    QHash<QString, int>::iterator it = m_subscriptions.find(key);
+    if (it == m_subscriptions.end() || --it.value() > 0)
+        return;
+    m_subscriptions.erase(it);
+    if (db.isOpen())
+        db.driver()->unsubscribeFromNotification(tableName);
+}
+
+bool SqlFileEngineHandler::createFullText(const QString &connectionName,
+                                          const QString &tableName) const
+{
+    QSqlDatabase db = database(connectionName);
+    QString textTable = SqlFileEngine::textTableName(tableName);
+    SqlFsMount *fsMount = mount(connectionName, tableName);
+    if (!db.isOpen())
+        return false;
+    QStringList tables = db.tables();
+    bool exists = tables.contains(textTable);
+    if (exists && !fsMount->staleText())
+        return true;
+
+    // The writer thread can't commit while the transaction is open, files
+    // stored before the index existed or while it was off are indexed
+    // along with its creation
+    waitForWrites(fsMount);
+    SqlTransaction transaction(db);
+
+    QSqlQuery qry(db);
+    if (exists) {
+        if (!qry.exec(QString("DELETE FROM %1").arg(textTable)))
+            return false;
+    } else if (!qry.exec(QString("CREATE VIRTUAL TABLE %1 USING fts5(content)")
+                         .arg(textTable))) {
+        qWarning("sqlfs: cannot index text of %s/%s, SQLite needs FTS5: %s",
+                 qPrintable(connectionName), qPrintable(tableName),
+                 qPrintable(qry.lastError().text()));
+        return false;
+    }
+    QStringList files;
+    if (tables.contains(tableName)) {
+        QSqlQuery &root = query(db, tableName, SelectRoot, fsMount);
+        root.bindValue(":name", tableName);
+        int node = root.exec() && root.next() ? root.value(0).toInt() : -1;
+        root.finish();
+
+        QSqlQuery &tree = query(db, tableName, SelectTree, fsMount);
+        tree.bindValue(":node", node);
+        tree.bindValue(":root", node);
+        if (!tree.exec())
+            return false;
+        while (tree.next()) {
+            if (!(tree.value(1).toUInt() & QAbstractFileEngine::DirectoryType) &&
+                    tree.value(2).toLongLong() <= SqlFileEngine::MaxIndexedFile)
+                files.append(tree.value(0).toString());
+        }
+        tree.finish();
+    }
+
+    QString prefix = "sql:/" + connectionName + '/' + tableName;
+    foreach (const QString &path, files) {
+        SqlFileEngine file(prefix + path, this);
+        if (!file.open(QIODevice::ReadOnly) || !file.updateText()) {
+            qWarning("sqlfs: could not index %s%s", qPrintable(prefix), qPrintable(path));
+            return false;
+        }
+        file.close();
+    }
+    if (!transaction.commit())
+        return false;
+    fsMount->setStaleText(false);
+    return true;
+}
+
+SqlFsBatch::SqlFsBatch(const SqlFileEngineHandler *handler, const QString &path,
+                       int maxOps, qint64 maxBytes) :
+    m_handler(handler),
+    m_connectionName(path.section('/', 1, 1)),
+    m_active(false)
+{
+    m_active = m_handler->beginBatch(m_connectionName, maxOps, maxBytes);
+}
+
+SqlFsBatch::~SqlFsBatch()
+{
+    if (m_active)
+        m_handler->endBatch(m_connectionName, true);
+}
+
+bool SqlFsBatch::isActive() const
+{
+    return m_active;
+}
+
+bool SqlFsBatch::commit()
+{
+    if (!m_active)
+        return false;
+
+    m_active = false;
+    return m_handler->endBatch(m_connectionName, true);
+}
+
+void SqlFsBatch::rollback()
+{
+    if (!m_active)
+        return;
+
+    m_active = false;
+    m_handler->endBatch(m_connectionName, false);
+}
+
+static void submitRequest(SqlFsRequest *request)
+{
+    SqlFileEngineHandler *handler = SqlFileEngineHandler::instance();
+    if (handler) {
+        handler->submit(request);
+    } else {
+        request->finish(false);
+        delete request;
+    }
+}
+
+QFuture<QByteArray> SqlFs::readAll(const QString &path)
+{
+    SqlFsReadRequest *request = new SqlFsReadRequest(path);
+    QFuture<QByteArray> future = request->future();
+    submitRequest(request);
+    return future;
+}
+
+QFuture<bool> SqlFs::writeAll(const QString &path, const QByteArray &data)
+{
+    SqlFsWriteRequest *request = new SqlFsWriteRequest(path, data);
+    QFuture<bool> future = request->future();
+    submitRequest(request);
+    return future;
+}
+
+QFuture<QStringList> SqlFs::entryList(const QString &path, QDir::Filters filters)
+{
+    SqlFsListRequest *request = new SqlFsListRequest(path, filters);
+    QFuture<QStringList> future = request->future();
+    submitRequest(request);
+    return future;
+}
+
+const qint64 SqlFsPack::MaxPooledFile;
+const qint64 SqlFsPack::MaxPendingBytes;
+
+SqlFsPack::SqlFsPack(const SqlFileEngineHandler *handler) :
+    m_handler(handler),
+    m_mount(0),
+    m_threadCount(0),
+    m_fileCount(0),
+    m_byteCount(0)
+{
+}
+
+void SqlFsPack::setThreadCount(int threadCount)
+{
+    m_threadCount = threadCount;
+}
+
+bool SqlFsPack::pack(const QString &sourceDir, const QString &path)
+{
+    m_fileCount = 0;
+    m_byteCount = 0;
+    m_errorString.clear();
+
+    QDir source(sourceDir);
+    if (!source.exists())
+        return fail(QString("%1 does not exist").arg(sourceDir));
+
+    // Also creates and migrates the table
+    QString target = m_handler->stripOptions(QDir::fromNativeSeparators(path));
+    QDir dir(target);
+    if (!dir.exists() && !dir.mkpath(target))
+        return fail(QString("could not create %1").arg(target));
+
+    QString connectionName = target.section('/', 1, 1);
+    QStringList components = target.section('/', 2).split('/', QString::SkipEmptyParts);
+    QString tableName = components.value(0);
+    QSqlDatabase db = m_handler->database(connectionName);
+    m_mount = m_handler->mount(connectionName, tableName);
+    m_handler->waitForWrites(m_mount);
+
+    int root = resolve(db, components);
+    if (root < 0)
+        return fail(QString("could not resolve %1").arg(target));
+
+    // Parents sort before their children
+    QStringList dirs;
+    QList<QFileInfo> files;
+    QDirIterator it(source.absolutePath(),
+                    QDir::AllEntries | QDir::NoDotAndDotDot | QDir::Hidden,
+                    QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+        it.next();
+        if (it.fileInfo().isDir())
+            dirs.append(source.relativeFilePath(it.filePath()));
+        else
+            files.append(it.fileInfo());
+    }
+    dirs.sort();
+
+    bool ok = true;
+    {
+        SqlFsBatch batch(m_handler, target);
+
+        QHash<QString, int> nodes;
+        nodes.insert(QString(), root);
+        foreach (const QString &dirPath, dirs) {
+            int node = makeNode(db, tableName, nodes.value(dirPath.section('/', 0, -2), -1),
+                                dirPath.section('/', -1), true);
+            if (node < 0) {
+                ok = fail(QString("could not create directory %1").arg(dirPath));
+                break;
+            }
+            nodes.insert(dirPath, node);
+        }
+
+        QThreadPool pool;
+        if (m_threadCount > 0)
+            pool.setMaxThreadCount(m_threadCount);
+        SqlFsPackQueue queue(MaxPendingBytes);
+
+        QList<QFileInfo> large;
+        int pooled = 0;
+        foreach (const QFileInfo &info, files) {
+            if (!ok)
+                break;
+            if (info.size() > MaxPooledFile) {
+                large.append(info);
+                continue;
+            }
+            pool.start(new SqlFsPackReader(&queue, info.absoluteFilePath(),
+                                           source.relativeFilePath(info.absoluteFilePath())));
+            pooled++;
+        }
+
+        // Files are stored in the order they have been read, all of them
+        // are taken so no reader stays blocked
+        for (int i = 0; i < pooled; i++) {
+            SqlFsPackItem item = queue.take();
+            if (!ok)
+                continue;
+
+            QBuffer buffer(&item.data);
+            buffer.open(QIODevice::ReadOnly);
+            if (!item.ok || !storeFile(db, tableName, nodes.value(item.path.section('/', 0, -2), -1),
+                                       item.path.section('/', -1), &buffer))
+                ok = fail(QString("could not pack %1").arg(item.path));
+        }
+        pool.waitForDone();
+
+        for (int i = 0; ok && i < large.size(); i++) {
+            QString filePath = source.relativeFilePath(large.at(i).absoluteFilePath());
+            QFile file(large.at(i).absoluteFilePath());
+            if (!file.open(QIODevice::ReadOnly) ||
+                    !storeFile(db, tableName, nodes.value(filePath.section('/', 0, -2), -1),
+                               filePath.section('/', -1), &file))
+                ok = fail(QString("could not pack %1").arg(filePath));
+        }
+
+        if (ok)
+            ok = !batch.isActive() || batch.commit() || fail("commit failed");
+        else
+            batch.rollback();
+    }
+
+    // Rows have been written around the lookup caches
+    m_mount->clear();
+    return ok;
+}
+
+bool SqlFsPack::unpack(const QString &path, const QString &destDir)
+{
+    m_fileCount = 0;
+    m_byteCount = 0;
+    m_errorString.clear();
+
+    QString target = m_handler->stripOptions(QDir::fromNativeSeparators(path));
+    QString connectionName = target.section('/', 1, 1);
+    QStringList components = target.section('/', 2).split('/', QString::SkipEmptyParts);
+    QString tableName = components.value(0);
+    QSqlDatabase db = m_handler->database(connectionName);
+    if (!db.isValid() || !QDir(target).exists())
+        return fail(QString("%1 does not exist").arg(target));
+
+    m_mount = m_handler->mount(connectionName, tableName);
+    m_handler->waitForWrites(m_mount);
+    int root = resolve(db, components);
+
+    // The whole tree is listed before contents are read
+    QList<QPair<QString, qint64> > files;
+    QStringList dirs;
+    QSqlQuery &qry = m_handler->query(db, tableName, SqlFileEngineHandler::SelectTree,
+                                      m_mount);
+    qry.bindValue(":node", root);
+    qry.bindValue(":root", root);
+    if (!qry.exec())
+        return fail(qry.lastError().text());
+    while (qry.next()) {
+        if (qry.value(1).toUInt() & QAbstractFileEngine::DirectoryType)
+            dirs.append(qry.value(0).toString());
+        else
+            files.append(qMakePair(qry.value(0).toString(), qry.value(2).toLongLong()));
+    }
+    qry.finish();
+
+    QDir dest(destDir);
+    if (!dest.mkpath("."))
+        return fail(QString("could not create %1").arg(destDir));
+    foreach (const QString &dirPath, dirs) {
+        if (!dest.mkpath(dirPath.mid(1)))
+            return fail(QString("could not create %1").arg(dest.filePath(dirPath.mid(1))));
+    }
+
+    QThreadPool pool;
+    if (m_threadCount > 0)
+        pool.setMaxThreadCount(m_threadCount);
+    QAtomicInt failures;
+    qint64 pending = 0;
+
+    // One transaction for all reads
+    SqlFsBatch batch(m_handler, target);
+    bool ok = true;
+    for (int i = 0; ok && i < files.size(); i++) {
+        QString filePath = files.at(i).first.mid(1);
+        QFile in(target + '/' + filePath);
+        if (!in.open(QIODevice::ReadOnly)) {
+            ok = fail(QString("could not read %1").arg(filePath));
+            break;
+        }
+
+        if (files.at(i).second <= MaxPooledFile) {
+            QByteArray data = in.readAll();
+            pending += data.size();
+            pool.start(new SqlFsUnpackWriter(dest.filePath(filePath), data, &failures));
+            if (pending > MaxPendingBytes) {
+                pool.waitForDone();
+                pending = 0;
+            }
+        } else {
+            QFile out(dest.filePath(filePath));
+            if (!out.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+                ok = fail(QString("could not write %1").arg(out.fileName()));
+                break;
+            }
+            while (ok && !in.atEnd()) {
+                QByteArray data = in.read(16 * SqlFileEngine::ChunkSize);
+                if (data.isEmpty() || out.write(data) != data.size())
+                    ok = fail(QString("could not unpack %1").arg(filePath));
+            }
+        }
+
+        m_fileCount++;
+        m_byteCount += in.size();
+    }
+    pool.waitForDone();
+
+    if (ok && failures.load() > 0)
+        ok = fail(QString("could not write %1 files").arg(failures.load()));
+    return ok;
+}
+
+int SqlFsPack::fileCount() const
+{
+    return m_fileCount;
+}
+
+qint64 SqlFsPack::byteCount() const
+{
+    return m_byteCount;
+}
+
+QString SqlFsPack::errorString() const
+{
+    return m_errorString;
+}
+
+bool SqlFsPack::fail(const QString &error)
+{
+    if (m_errorString.isEmpty())
+        m_errorString = error;
+    return false;
+}
+
+int SqlFsPack::resolve(const QSqlDatabase &db, const QStringList &path)
+{
+    if (path.isEmpty())
+        return -1;
+
+    QSqlQuery &root = m_handler->query(db, path.first(), SqlFileEngineHandler::SelectRoot,
+                                       m_mount);
+    root.bindValue(":name", path.first());
+    int node = root.exec() && root.next() ? root.value(0).toInt() : -1;
+    root.finish();
+
+    for (int i = 1; node >= 0 && i < path.size(); i++) {
+        QSqlQuery &child = m_handler->query(db, path.first(), SqlFileEngineHandler::SelectChild,
+                                            m_mount);
+        child.bindValue(":parent", node);
+        child.bindValue(":name", path.at(i));
+        node = child.exec() && child.next() ? child.value(0).toInt() : -1;
+        child.finish();
+    }
+    return node;
+}
+
+int SqlFsPack::makeNode(const QSqlDatabase &db, const QString &tableName, int parent,
+                        const QString &name, bool directory)
+{
+    if (parent < 0)
+        return -1;
+
+    QSqlQuery &select = m_handler->query(db, tableName, SqlFileEngineHandler::SelectChild,
+                                         m_mount);
+    select.bindValue(":parent", parent);
+    select.bindValue(":name", name);
+    bool found = select.exec() && select.next();
+    int node = found ? select.value(0).toInt() : -1;
+    select.finish();
+
+    if (found) {
+        // Directories are merged, files replaced. A file in the way of a
+        // directory or the other way round is an error.
+        QSqlQuery &stat = m_handler->query(db, tableName, SqlFileEngineHandler::SelectStat,
+                                           m_mount);
+        stat.bindValue(":rowid", node);
+        bool isDir = stat.exec() && stat.next() &&
+                (stat.value(0).toUInt() & QAbstractFileEngine::DirectoryType);
+        stat.finish();
+        if (isDir != directory)
+            return -1;
+        if (directory)
+            return node;
+
+        QSqlQuery &chunks = m_handler->query(db, tableName, SqlFileEngineHandler::DeleteChunks,
+                                             m_mount);
+        chunks.bindValue(":node", node);
+        QSqlQuery &data = m_handler->query(db, tableName, SqlFileEngineHandler::ClearData,
+                                           m_mount);
+        data.bindValue(":rowid", node);
+        return chunks.exec() && data.exec() ? node : -1;
+    }
+
+    QAbstractFileEngine::FileFlags flags = QAbstractFileEngine::ExistsFlag |
+            QAbstractFileEngine::ReadUserPerm | QAbstractFileEngine::WriteUserPerm;
+    flags |= directory ? QAbstractFileEngine::DirectoryType : QAbstractFileEngine::FileType;
+
+    QSqlQuery &insert = m_handler->query(db, tableName, SqlFileEngineHandler::InsertNode,
+                                         m_mount);
+    insert.bindValue(":parent", parent);
+    insert.bindValue(":name", name);
+    insert.bindValue(":flags", static_cast<int>(flags));
+    bool ok = insert.exec();
+    m_handler->batchStep(db, ok);
+    return ok ? insert.lastInsertId().toInt() : -1;
+}
+
+bool SqlFsPack::storeFile(const QSqlDatabase &db, const QString &tableName, int parent,
+                          const QString &name, QIODevice *device)
+{
+    int node = makeNode(db, tableName, parent, name, false);
+    if (node < 0)
+        return false;
+
+    SqlFsMountOptions options = m_mount->options();
+    const SqlFsCodec *codec = m_handler->codec(options.compression);
+    bool fullText = m_mount->indexesText();
+
+    // Text is collected while the chunks pass by, replaced files lose
+    // their old text in any case
+    qint64 size = 0;
+    QByteArray content;
+    for (qint64 idx = 0; !device->atEnd(); idx++) {
+        QByteArray chunk = device->read(SqlFileEngine::ChunkSize);
+        if (chunk.isEmpty() ||
+                !storeChunk(m_handler, db, m_mount, tableName, node, idx, chunk,
+                            options.deduplicate, codec))
+            return false;
+        size += chunk.size();
+        if (fullText && size <= SqlFileEngine::MaxIndexedFile)
+            content.append(chunk);
+    }
+
+    QString text;
+    if (fullText && size <= SqlFileEngine::MaxIndexedFile)
+        decodeText(content, &text);
+    if (fullText && !storeText(m_handler, db, m_mount, tableName, node, text))
+        return false;
+
+    QSqlQuery &metadata = m_handler->query(db, tableName, SqlFileEngineHandler::UpdateMetadata,
+                                           m_mount);
+    metadata.bindValue(":size", size);
+    metadata.bindValue(":rowid", node);
+    bool ok = metadata.exec();
+    m_handler->batchStep(db, ok, size);
+    if (!ok)
+        return false;
+
+    m_fileCount++;
+    m_byteCount += size;
+    return true;
+}
+
+SqlFsWatcher::SqlFsWatcher(const SqlFileEngineHandler *handler, QObject *parent) :
+    QObject(parent),
+    m_handler(handler),
+    m_pollTimer(new QTimer(this)),
+    m_notifyTimer(new QTimer(this))
+{
+    m_pollTimer->setInterval(DefaultInterval);
+    connect(m_pollTimer, SIGNAL(timeout()), this, SLOT(poll()));
+
+    // Notifications arrive row by row, they are processed together
+    m_notifyTimer->setSingleShot(true);
+    m_notifyTimer->setInterval(0);
+    connect(m_notifyTimer, SIGNAL(timeout()), this, SLOT(processNotifications()));
+}
+
+SqlFsWatcher::~SqlFsWatcher()
+{
+    foreach (const QString &mountKey, m_mounts.keys()) {
+        m_mounts[mountKey].watches = 1;
+        release(mountKey);
+    }
+}
+
+bool SqlFsWatcher::addPath(const QString &path)
+{
+    if (!path.startsWith(QLatin1String("sql:/")) || m_watches.contains(path))
+        return false;
+
+    QString connectionName = path.section('/', 1, 1);
+    QString tableName = path.section('/', 2, 2).section('?', 0, 0);
+    if (connectionName.isEmpty() || tableName.isEmpty())
+        return false;
+
+    // Versions are read before the snapshot, changes in between are
+    // reported by the next poll
+    QString mountKey = connectionName + '/' + tableName;
+    QHash<QString, WatchedMount>::iterator it = m_mounts.find(mountKey);
+    if (it == m_mounts.end()) {
+        WatchedMount mount;
+        mount.connectionName = connectionName;
+        mount.tableName = tableName;
+        mount.driver = m_handler->database(connectionName).driver();
+        mount.subscribed = m_handler->subscribe(connectionName, tableName);
+        if (mount.subscribed)
+            connect(mount.driver, SIGNAL(notification(QString,QSqlDriver::NotificationSource,QVariant)),
+                    this, SLOT(notified(QString,QSqlDriver::NotificationSource,QVariant)),
+                    Qt::UniqueConnection);
+        mount.dataVersion = readDataVersion(mount);
+        mount.changes = readChanges(mount);
+        mount.watches = 0;
+        it = m_mounts.insert(mountKey, mount);
+    }
+    it->watches++;
+
+    Watch watch = snapshot(path, mountKey);
+    if (!watch.exists) {
+        release(mountKey);
+        return false;
+    }
+
+    m_watches.insert(path, watch);
+    if (!m_pollTimer->isActive())
+        m_pollTimer->start();
+    return true;
+}
+
+QStringList SqlFsWatcher::addPaths(const QStringList &paths)
+{
+    QStringList failed;
+    foreach (const QString &path, paths) {
+        if (!addPath(path))
+            failed.append(path);
+    }
+    return failed;
+}
+
+bool SqlFsWatcher::removePath(const QString &path)
+{
+    QMap<QString, Watch>::iterator it = m_watches.find(path);
+    if (it == m_watches.end())
+        return false;
+
+    QString mountKey = it->mountKey;
+    m_watches.erase(it);
+    release(mountKey);
+    return true;
+}
+
+QStringList SqlFsWatcher::removePaths(const QStringList &paths)
+{
+    QStringList failed;
+    foreach (const QString &path, paths) {
+        if (!removePath(path))
+            failed.append(path);
+    }
+    return failed;
+}
+
+QStringList SqlFsWatcher::files() const
+{
+    QStringList paths;
+    QMap<QString, Watch>::const_iterator it;
+    for (it = m_watches.constBegin(); it != m_watches.constEnd(); ++it) {
+        if (!it->directory)
+            paths.append(it.key());
+    }
+    return paths;
+}
+
+QStringList SqlFsWatcher::directories() const
+{
+    QStringList paths;
+    QMap<QString, Watch>::const_iterator it;
+    for (it = m_watches.constBegin(); it != m_watches.constEnd(); ++it) {
+        if (it->directory)
+            paths.append(it.key());
+    }
+    return paths;
+}
+
+int SqlFsWatcher::interval() const
+{
+    return m_pollTimer->interval();
+}
+
+void SqlFsWatcher::setInterval(int msecs)
+{
+    m_pollTimer->setInterval(msecs);
+}
+
+void SqlFsWatcher::notified(const QString &name, QSqlDriver::NotificationSource source,
+                            const QVariant &payload)
+{
+    Q_UNUSED(source);
+
+    // The payload of QSQLITE notifications is the rowid of the changed row
+    QHash<QString, WatchedMount>::const_iterator it;
+    for (it = m_mounts.constBegin(); it != m_mounts.constEnd(); ++it) {
+        if (it->driver.data() == sender() && it->tableName == name) {
+            m_notified[it.key()].insert(payload.toInt());
+            m_notifyTimer->start();
+        }
+    }
+}
+
+void SqlFsWatcher::processNotifications()
+{
+    QHash<QString, QSet<int> > notified;
+    notified.swap(m_notified);
+
+    QHash<QString, QSet<int> >::const_iterator it;
+    for (it = notified.constBegin(); it != notified.constEnd(); ++it) {
+        if (m_mounts.contains(it.key()))
+            check(it.key(), it.value(), false);
+    }
+}
+
+void SqlFsWatcher::poll()
+{
+    foreach (const QString &mountKey, m_mounts.keys()) {
+        QHash<QString, WatchedMount>::iterator it = m_mounts.find(mountKey);
+        if (it == m_mounts.end())
+            continue;
+
+        // Only commits of other connections change the data version, the
+        // change counter tells if they touched this table
+        qint64 dataVersion = readDataVersion(*it);
+        if (dataVersion == it->dataVersion)
+            continue;
+        it->dataVersion = dataVersion;
+
+        qint64 changes = readChanges(*it);
+        if (changes == it->changes)
+            continue;
+        it->changes = changes;
+
+        // Caches of the mount only follow changes made through sqlfs
+        m_handler->mount(it->connectionName, it->tableName)->clear();
+        check(mountKey, QSet<int>(), true);
+    }
+}
+
+SqlFsWatcher::Watch SqlFsWatcher::snapshot(const QString &path, const QString &mountKey) const
+{
+    Watch watch;
+    watch.mountKey = mountKey;
+    watch.exists = false;
+    watch.directory = false;
+    watch.size = 0;
+
+    QScopedPointer<QAbstractFileEngine> created(m_handler->create(path));
+    SqlFileEngine *engine = static_cast<SqlFileEngine *>(created.data());
+    watch.node = engine ? engine->m_nodeId : -1;
+
+    SqlFsStat stat;
+    if (watch.node < 0 || !engine->loadStat(&stat))
+        return watch;
+
+    watch.exists = true;
+    watch.directory = stat.flags & QAbstractFileEngine::DirectoryType;
+    watch.size = stat.size;
+    watch.modified = stat.modified.isValid() ? stat.modified : stat.created;
+
+    if (watch.directory) {
+        QScopedPointer<QAbstractFileEngineIterator> it(
+                    engine->beginEntryList(QDir::AllEntries | QDir::NoDotAndDotDot,
+                                           QStringList()));
+        while (it->hasNext()) {
+            it->next();
+            watch.entries.append(it->currentFileName());
+        }
+        watch.entries.sort();
+    }
+    return watch;
+}
+
+void SqlFsWatcher::check(const QString &mountKey, const QSet<int> &nodes, bool external)
+{
+    QStringList changedFiles;
+    QStringList changedDirectories;
+    int removed = 0;
+
+    QMutableMapIterator<QString, Watch> it(m_watches);
+    while (it.hasNext()) {
+        it.next();
+        Watch &watch = it.value();
+        if (watch.mountKey != mountKey)
+            continue;
+
+        // Hook notifications name the changed nodes, files only look at
+        // their own. Entries of directories are listed again.
+        bool notified = nodes.contains(watch.node);
+        if (!watch.directory && !external && !notified)
+            continue;
+
+        Watch current = snapshot(it.key(), mountKey);
+        bool changed = !current.exists || current.node != watch.node ||
+                current.directory != watch.directory;
+        if (watch.directory)
+            changed = changed || current.entries != watch.entries;
+        else
+            changed = changed || notified || current.size != watch.size ||
+                    current.modified != watch.modified;
+        if (!changed)
+            continue;
+
+        if (watch.directory)
+            changedDirectories.append(it.key());
+        else
+            changedFiles.append(it.key());
+
+        // Paths replaced by a node of the same type are still watched
+        if (current.exists && current.directory == watch.directory) {
+            watch = current;
+        } else {
+            it.remove();
+            removed++;
+        }
+    }
+
+    for (int i = 0; i < removed; i++)
+        release(mountKey);
+
+    foreach (const QString &path, changedFiles)
+        emit fileChanged(path);
+    foreach (const QString &path, changedDirectories)
+        emit directoryChanged(path);
+}
+
+qint64 SqlFsWatcher::readDataVersion(const WatchedMount &mount) const
+{
+    QSqlQuery &qry = m_handler->query(m_handler->database(mount.connectionName),
+                                      mount.tableName,
+                                      SqlFileEngineHandler::SelectDataVersion,
+                                      m_handler->mount(mount.connectionName, mount.tableName));
+    qint64 dataVersion = qry.exec() && qry.next() ? qry.value(0).toLongLong() : -1;
+    qry.finish();
+    return dataVersion;
+}
+
+qint64 SqlFsWatcher::readChanges(const WatchedMount &mount) const
+{
+    QSqlQuery &qry = m_handler->query(m_handler->database(mount.connectionName),
+                                      mount.tableName,
+                                      SqlFileEngineHandler::SelectChanges,
+                                      m_handler->mount(mount.connectionName, mount.tableName));
+    qry.bindValue(":name", mount.tableName);
+    qint64 changes = qry.exec() && qry.next() ? qry.value(0).toLongLong() : -1;
+    qry.finish();
+    return changes;
+}
+
+void SqlFsWatcher::release(const QString &mountKey)
+{
+    QHash<QString, WatchedMount>::iterator it = m_mounts.find(mountKey);
+    if (it == m_mounts.end() || --it->watches > 0)
+        return;
+
+    QPointer<QSqlDriver> driver = it->driver;
+    if (it->subscribed)
+        m_handler->unsubscribe(it->connectionName, it->tableName);
+    m_mounts.erase(it);
+    m_notified.remove(mountKey);
+
+    // Other mounts may share the connection
+    bool connected = false;
+    foreach (const WatchedMount &mount, m_mounts)
+        connected = connected || (mount.subscribed && mount.driver == driver);
+    if (driver && !connected)
+        disconnect(driver, 0, this, 0);
+
+    if (m_mounts.isEmpty())
+        m_pollTimer->stop();
+}
+
+SqlFileEngine::SqlFileEngine(const QString &fileName,
+                             const SqlFileEngineHandler *handler) :
+    QAbstractFileEngine(),
+    m_handler(handler),
+    m_mount(0),
+    m_openMode(QIODevice::NotOpen),
+    m_absoluteFileName(fileName),
+    m_size(0),
+    m_pos(0),
+    m_loaded(false),
+    m_legacy(false),
+    m_modified(false),
+    m_textStale(false),
+    m_storedBytes(0),
+    m_truncate(false),
+    m_truncateIdx(-1)
+{
+    // The handler only creates engines for valid URLs
+    splitUrl(fileName, &m_connectionName, &m_filePath);
+    m_db = m_handler->database(m_connectionName);
+
+    QStringList list = splitPath(m_filePath);
+
+    m_tableName = list.first();
+    m_fileName = list.last();
+
+    list.removeLast();
+    m_path = list.join('/');
+
+    // Mounts are checked once, later engines only look them up
+    m_mount = m_handler->mount(m_db.connectionName(), m_tableName);
+    if (!m_mount->isChecked())
+        createTable(m_handler, m_tableName, m_db);
+    m_mount->count(SqlFsStatistics::Engines);
+    if (m_mount->preloads())
+        loadIndex();
+    m_nodeId = node(m_filePath);
+}
+
+SqlFileEngine::~SqlFileEngine()
+{
+    // Mappings live as long as the engine, like those of QFSFileEngine
+    foreach (uchar *address, m_mappings.keys())
+        unmapRegion(address);
+}
+
+QAbstractFileEngine::FileFlags SqlFileEngine::fileFlags(QAbstractFileEngine::FileFlags type) const
+{
+    Q_UNUSED(type);
+
+    FileFlags ret = 0;
+
+    if (m_filePath.isEmpty()) {
+        ret = DirectoryType | ExistsFlag | ReadUserPerm | WriteUserPerm;
+    } else {
+        SqlFsStat stat;
+        if (loadStat(&stat))
+            ret = static_cast<FileFlags>(stat.flags);
+    }
+
+    return ret;
+}
+
+QDateTime SqlFileEngine::fileTime(FileTime time) const
+{
+    SqlFsStat stat;
+    if (!loadStat(&stat))
+        return QDateTime();
+
+    // Files never written since their creation have no write date
+    switch (time) {
+    case BirthTime:
+        return stat.created;
+    default:
+        return stat.modified.isValid() ? stat.modified : stat.created;
+    }
+}
+
+QString SqlFileEngine::fileName(QAbstractFileEngine::FileName file) const
+{
+    switch (file) {
+    case DefaultName:
+    case AbsoluteName:
+        return m_absoluteFileName;
+
+    default:
+        break;
+    }
+
+    return m_absoluteFileName;
+}
+
+QAbstractFileEngine::Iterator *SqlFileEngine::beginEntryList(
+        QDir::Filters filters, const QStringList &filterNames)
+{
+    return new SqlFileEngineIterator(this, filters, filterNames);
+}
+
+bool SqlFileEngine::open(QIODevice::OpenMode openMode)
+{
+    SqlFsTimer timer(m_mount, SqlFsStatistics::Open);
+
+    if (m_nodeId < 0) {
+        int parent = node(m_path);
+        if (parent < 0)
+             return false;
+
+        QSqlQuery &qry = query(SqlFileEngineHandler::InsertNode);
+        qry.bindValue(":parent", parent);
+
+        qry.bindValue(":flags", static_cast<int>(
+                FileType | ExistsFlag | ReadUserPerm | WriteUserPerm));
+        qry.bindValue(":name", m_fileName);
+
+        bool ok = qry.exec();
+        m_handler->batchStep(m_db, ok);
+        if (!ok)
+            return false;
+
+        m_nodeId = qry.lastInsertId().toInt();
+        m_mount->insert(parent, m_fileName, m_nodeId);
+    }
+
+    m_openMode = openMode;
+    m_storeTimer.start();
+
+    // Contents a failed close() could not store stay buffered, the next
+    // flush() or close() stores them again
+    if (m_modified)
+        m_pos = 0;
+    else if (!loadFile())
+        return false;
+
+    if (openMode & QIODevice::Truncate)
+        return setSize(0);
+
+    return true;
+}
+
+bool SqlFileEngine::mkdir(const QString &dirName, bool createParentDirectories) const
+{
+    Q_UNUSED(createParentDirectories);
+
+    QString connectionName;
+    QString path;
+    if (splitUrl(m_handler->stripOptions(dirName), &connectionName, &path)) {
+        QSqlDatabase db = m_handler->database(connectionName);
+        QStringList list = splitPath(path);
+        if (list.isEmpty())
+            return false;
+
+        QString tableName = list.first();
+
+        createTable(m_handler, tableName, db);
+
+        // Check if directory already exists
+        if (node(path, db) >= 0)
+            return false;
+
+        SqlFsMount *mount = m_handler->mount(db.connectionName(), tableName);
+
+        if (createParentDirectories) {
+            list.removeFirst(); // remove root file
+
+            int parent = 0;
+            for (int i = 0; i < list.size(); i++) {
+                int id = child(parent, list.at(i), db, mount, tableName);
+                if (id >= 0) {
+                    parent = id;
+                } else {
+                    // not found => create
+                    QSqlQuery &insQuery = query(SqlFileEngineHandler::InsertNode,
+                                                db, mount, tableName);
+                    insQuery.bindValue(":parent", parent);
+                    insQuery.bindValue(":name", list.at(i));
+                    insQuery.bindValue(":flags", static_cast<unsigned>(
+                            DirectoryType | ExistsFlag | ReadUserPerm | WriteUserPerm));
+                    bool ok = insQuery.exec();
+                    m_handler->batchStep(db, ok);
+                    if (!ok)
+                        return false;
+                    id = insQuery.lastInsertId().toInt();
+                    mount->insert(parent, list.at(i), id);
+                    parent = id;
+                }
+            }
+        } else {
+            // Check for the parent directory to exist otherwise fail
+            QString newDir = list.last();
+            list.removeLast();
+
+            int parent = node(list.join('/'), db);
+            if (parent < 0 || newDir.isEmpty())
+                return false;
+
+            QSqlQuery &qry = query(SqlFileEngineHandler::InsertNode, db, mount, tableName);
+            qry.bindValue(":parent", parent);
+            qry.bindValue(":name", newDir);
+            qry.bindValue(":flags", static_cast<unsigned>(
+                    DirectoryType | ExistsFlag | ReadUserPerm | WriteUserPerm));
+
+            bool ok = qry.exec();
+            m_handler->batchStep(db, ok);
+            if (!ok)
+                return false;
+
+            mount->insert(parent, newDir, qry.lastInsertId().toInt());
+            return true;
+        }
+
+    }
+    return true;
+}
+
+bool SqlFileEngine::rmdir(const QString &dirName, bool recurseParentDirectories) const
+{
+    QString connectionName;
+    QString filePath;
+    if (!splitUrl(m_handler->stripOptions(QDir::fromNativeSeparators(dirName)),
+                  &connectionName, &filePath))
+        return false;
+
+    QSqlDatabase db = m_handler->database(connectionName);
+    QStringList list = splitPath(filePath);
+    if (list.isEmpty())
+        return false;
+
+    QString tableName = list.first();
+
+    int nodeId = node(filePath, db);
+
+    if (nodeId < 0)
+        return false;
+
+    // Queued contents below the directory must not outlive it
+    SqlFsMount *mount = m_handler->mount(db.connectionName(), tableName);
+    m_handler->waitForWrites(mount);
+
+    if (!recurseParentDirectories) {
+        QSqlQuery &qry = query(SqlFileEngineHandler::CountChildren, db, mount, tableName);
+        qry.bindValue(":parent", nodeId);
+        bool empty = qry.exec() && qry.next() && qry.value(0).toInt() == 0;
+        qry.finish();
+        if (!empty)
+            return false;
+    }
+
+    // Subtrees go in one statement, foreign keys are not enforced
+    bool ok;
+    if (recurseParentDirectories) {
+        SqlTransaction transaction(db);
+        ok = deleteTree(nodeId, db, mount, tableName) && transaction.commit();
+    } else {
+        QSqlQuery &qry = query(SqlFileEngineHandler::DeleteNode, db, mount, tableName);
+        qry.bindValue(":rowid", nodeId);
+        ok = qry.exec();
+    }
+    m_handler->batchStep(db, ok);
+    if (!ok)
+        return false;
+
+    m_handler->scheduleVacuum(db.connectionName(), tableName);
+
+    if (recurseParentDirectories) {
+        mount->clear();
+    } else {
+        mount->removeStat(nodeId);
+        QString name = list.last();
+        list.removeLast();
+        mount->remove(node(list.join('/'), db), name);
+    }
+
+    return true;
+}
+
+bool SqlFileEngine::remove()
+{
+    if (m_nodeId >= 0) {
+        m_handler->waitForWrites(m_mount, m_nodeId);
+
+        QSqlQuery &chunks = query(SqlFileEngineHandler::DeleteChunks);
+        chunks.bindValue(":node", m_nodeId);
+        QSqlQuery &qry = query(SqlFileEngineHandler::DeleteNode);
+        qry.bindValue(":rowid", m_nodeId);
+
+        bool ok;
+        {
+            SqlTransaction transaction(m_db);
+            ok = chunks.exec() && qry.exec() &&
+                    (!m_mount->indexesText() ||
+                     storeText(m_handler, m_db, m_mount, m_tableName, m_nodeId, QString())) &&
+                    transaction.commit();
+        }
+        m_handler->batchStep(m_db, ok);
+        if (!ok)
+            return false;
+
+        m_handler->scheduleVacuum(m_connectionName, m_tableName);
+
+        m_mount->remove(node(m_path), m_fileName);
+        m_mount->removeStat(m_nodeId);
+        m_nodeId = -1;
+        return true;
+    }
+    return false;
+}
+
+bool SqlFileEngine::rename(const QString &newName)
+{
+    // Returning false outside of sqlfs lets QFile copy and remove instead
+    return transfer(newName, true);
+}
+
+bool SqlFileEngine::copy(const QString &newName)
+{
+    return transfer(newName, false);
+}
+
+qint64 SqlFileEngine::size() const
+{
+    if (m_loaded)
+        return m_size;
+
+    // Answered from metadata, the content is not needed
+    SqlFsStat stat;
+    if (loadStat(&stat))
+        return stat.size;
+
+    return 0;
+}
+
+bool SqlFileEngine::setSize(qint64 size)
+{
+    if (size < 0 || !loadMetadata())
+        return false;
+
+    if (m_legacy) {
+        if (size == 0) {
+            QSqlQuery &qry = query(SqlFileEngineHandler::ClearData);
+            qry.bindValue(":rowid", m_nodeId);
+            if (!qry.exec())
+                return false;
+            m_legacy = false;
+            m_modified = true;
+            m_textStale = true;
+        } else if (!convertLegacy()) {
+            return false;
+        }
+    }
+
+    if (size < m_size) {
+        // Chunks behind the new end are dropped on the next flush(), the
+        // last remaining one is trimmed in memory.
+        qint64 lastIdx = size > 0 ? (size - 1) / ChunkSize : -1;
+
+        QMutableHashIterator<qint64, QByteArray> it(m_chunks);
+        while (it.hasNext()) {
+            it.next();
+            if (it.key() > lastIdx) {
+                m_dirtyChunks.remove(it.key());
+                it.remove();
+            }
+        }
+
+        if (lastIdx >= 0) {
+            QByteArray *chunk = cachedChunk(lastIdx);
+            if (!chunk)
+                return false;
+            qint64 length = size - lastIdx * ChunkSize;
+            if (chunk->size() > length) {
+                chunk->truncate(length);
+                markDirty(lastIdx, 0, length);
+            }
+        }
+
+        if (!m_truncate || lastIdx < m_truncateIdx)
+            m_truncateIdx = lastIdx;
+        m_truncate = true;
+    } else if (size > m_size) {
+        // Growing only needs the new last chunk to be padded, the size of a
+        // file is determined by its last chunk. Missing chunks read as zeros.
+        qint64 lastIdx = (size - 1) / ChunkSize;
+        QByteArray *chunk = cachedChunk(lastIdx);
+        if (!chunk)
+            return false;
+        qint64 length = size - lastIdx * ChunkSize;
+        if (chunk->size() < length) {
+            int oldSize = chunk->size();
+            chunk->resize(length);
+            memset(chunk->data() + oldSize, 0, length - oldSize);
+            markDirty(lastIdx, oldSize, length);
+        }
+    }
+
+    if (size != m_size) {
+        m_modified = true;
+        m_textStale = true;
+    }
+
+    m_size = size;
+    if (m_pos > m_size)
+        m_pos = m_size;
+
+    // QFile::resize() may be called on files that are not open
+    if (m_openMode == QIODevice::NotOpen)
+        return store(true);
+
+    return true;
+}
+
+bool SqlFileEngine::seek(qint64 pos)
+{
+    if (pos < 0)
+        return false;
+
+    m_pos = pos;
+    return true;
+}
+
+qint64 SqlFileEngine::write(const char *data, qint64 len)
+{
+    if (!(m_openMode & QIODevice::WriteOnly) || !loadMetadata())
+        return -1;
+
+    // Legacy rows are patched in place as long as they do not grow
+    if (m_legacy && (m_pos + len > m_size || !sqliteHandle(m_db))) {
+        if (!convertLegacy())
+            return -1;
+    }
+
+    qint64 done = 0;
+    while (done < len) {
+        qint64 pos = m_pos + done;
+        qint64 idx = pos / ChunkSize;
+        qint64 offset = pos - idx * ChunkSize;
+        qint64 n = qMin(ChunkSize - offset, len - done);
+
+        QByteArray *chunk = cachedChunk(idx);
+        if (!chunk)
+            return done > 0 ? done : -1;
+
+        if (chunk->size() < offset + n) {
+            int oldSize = chunk->size();
+            chunk->resize(offset + n);
+            memset(chunk->data() + oldSize, 0, offset - qMin<qint64>(offset, oldSize));
+        }
+        memcpy(chunk->data() + offset, data + done, n);
+        markDirty(idx, offset, offset + n);
+
+        done += n;
+    }
+
+    m_pos += len;
+    if (m_pos > m_size)
+        m_size = m_pos;
+
+    if (len > 0) {
+        m_modified = true;
+        m_textStale = true;
+    }
+
+    m_mount->count(SqlFsStatistics::BytesWritten, len);
+    return len;
+}
+
+qint64 SqlFileEngine::read(char *data, qint64 maxlen)
+{
+    SqlFsTimer timer(m_mount, SqlFsStatistics::Read);
+    if (!loadMetadata())
+        return -1;
+
+    qint64 len = qBound<qint64>(0, m_size - m_pos, maxlen);
+
+    // Everything not modified by this engine is streamed straight from the
+    // database into the caller's buffer.
+    SqlBlob blob(m_db, m_legacy ? m_tableName : m_mount->chunkTable(), false);
+    SqlBlob shared(m_db, m_mount->blobTable(), false);
+
+    qint64 done = 0;
+    while (done < len) {
+        qint64 idx = m_pos / ChunkSize;
+        qint64 offset = m_pos - idx * ChunkSize;
+        qint64 n = qMin(ChunkSize - offset, len - done);
+
+        QHash<qint64, QByteArray>::const_iterator it = m_chunks.constFind(idx);
+        if (it != m_chunks.constEnd()) {
+            m_mount->count(SqlFsStatistics::ChunkCacheHits);
+            copyChunk(it.value(), offset, data + done, n);
+        } else if (blob.isValid()) {
+            m_mount->count(SqlFsStatistics::ChunkCacheMisses);
+            if (!readChunk(&blob, &shared, idx, offset, data + done, n))
+                return done > 0 ? done : -1;
+        } else {
+            QByteArray *chunk = cachedChunk(idx);
+            if (!chunk)
+                return done > 0 ? done : -1;
+            copyChunk(*chunk, offset, data + done, n);
+        }
+
+        done += n;
+        m_pos += n;
+    }
+
+    m_mount->count(SqlFsStatistics::BytesRead, len);
+    return len;
+}
+
+bool SqlFileEngine::flush()
+{
+    if (m_nodeId < 0)
+        return false;
+
+    // QFile::close() flushes first, contents are queued by close() then
+    SqlFsMountOptions options = m_mount->options();
+    if (options.writeBehind)
+        return true;
+
+    switch (options.flushPolicy) {
+    case SqlFsMountOptions::FlushAlways:
+        break;
+    case SqlFsMountOptions::FlushOnClose:
+        return true;
+    case SqlFsMountOptions::FlushTimed:
+        if (m_storeTimer.isValid() && !m_storeTimer.hasExpired(options.flushInterval))
+            return true;
+        break;
+    }
+
+    return store(false);
+}
+
+bool SqlFileEngine::store(bool final)
+{
+    if (m_nodeId < 0)
+        return false;
+
+    // Files only read never cause a write. Indexing reads the whole file,
+    // appending flushes leave that to the final store.
+    bool text = final && m_textStale && m_mount->indexesText();
+    if (!m_modified && !text)
+        return true;
+
+    SqlFsTimer timer(m_mount, SqlFsStatistics::Flush);
+    SqlTransaction transaction(m_db);
+
+    bool ok = storeChunks();
+    if (ok && m_modified) {
+        QSqlQuery &qry = query(SqlFileEngineHandler::UpdateMetadata);
+        qry.bindValue(":size", m_size);
+        qry.bindValue(":rowid", m_nodeId);
+        ok = qry.exec();
+    }
+    ok = ok && (!text || updateText()) && transaction.commit();
+    m_handler->batchStep(m_db, ok, m_storedBytes);
+    if (ok)
+        m_mount->count(SqlFsStatistics::BytesFlushed, m_storedBytes);
+    m_storedBytes = 0;
+    if (!ok)
+        return false;
+
+    m_mount->removeStat(m_nodeId);
+    m_modified = false;
+    if (final)
+        m_textStale = false;
+    m_storeTimer.start();
+    return true;
+}
+
+bool SqlFileEngine::close()
+{
+    // The writer's connection would be blocked by the transaction of this
+    // one, contents are stored within it instead
+    bool ok;
+    if (m_modified && !m_legacy && m_mount->options().writeBehind && !inTransaction(m_db))
+        ok = storeBehind();
+    else
+        ok = store(true);
+    m_openMode = QIODevice::NotOpen;
+    if (!ok)
+        return false;
+
+    m_chunks.clear();
+    m_dirtyChunks.clear();
+    return true;
+}
+
+bool SqlFileEngine::supportsExtension(Extension extension) const
+{
+    return extension == AtEndExtension ||
+            extension == MapExtension ||
+            extension == UnMapExtension;
+}
+
+bool SqlFileEngine::extension(Extension extension, const ExtensionOption *option,
+                              ExtensionReturn *output)
+{
+    switch (extension) {
+    case AtEndExtension:
+        return !loadMetadata() || m_pos >= m_size;
+    case MapExtension: {
+        const MapExtensionOption *map = static_cast<const MapExtensionOption *>(option);
+        MapExtensionReturn *ret = static_cast<MapExtensionReturn *>(output);
+        ret->address = mapRegion(map->offset, map->size, map->flags);
+        return ret->address != 0;
+    }
+    case UnMapExtension:
+        return unmapRegion(static_cast<const UnMapExtensionOption *>(option)->address);
+    default:
+        break;
+    }
+
+    return false;
+}
+
+QString SqlFileEngine::chunkTableName(const QString &tableName)
+{
+    return tableName + "_chunks";
+}
+
+QString SqlFileEngine::blobTableName(const QString &tableName)
+{
+    return tableName + "_blobs";
+}
+
+QString SqlFileEngine::textTableName(const QString &tableName)
+{
+    return tableName + "_text";
+}
+
+bool SqlFileEngine::loadFile()
+{
+    m_chunks.clear();
+    m_dirtyChunks.clear();
+    m_chunkRows.clear();
+    m_modified = false;
+    m_textStale = false;
+    m_truncate = false;
+    m_loaded = false;
+    m_pos = 0;
+
+    return m_nodeId >= 0;
+}
+
+bool SqlFileEngine::loadMetadata() const
+{
+    if (m_loaded)
+        return true;
+
+    m_size = 0;
+    m_legacy = false;
+
+    if (m_nodeId < 0)
+        return false;
+
+    // Contents still queued for writing have to be read back
+    m_handler->waitForWrites(m_mount, m_nodeId);
+
+    QSqlQuery &qry = query(SqlFileEngineHandler::SelectMetadata);
+    qry.bindValue(":rowid", m_nodeId);
+    if (qry.exec() && qry.next()) {
+        if (!qry.value(1).isNull()) {
+            m_size = qry.value(1).toLongLong();
+        } else if (!qry.value(0).isNull()) {
+            m_size = qry.value(0).toLongLong();
+            m_legacy = true;
+        }
+        m_loaded = true;
+    }
+    qry.finish();
+
+    return m_loaded;
+}
+
+bool SqlFileEngine::loadStat(SqlFsStat *stat) const
+{
+    if (m_nodeId < 0)
+        return false;
+
+    if (m_mount->stat(m_nodeId, stat))
+        return true;
+
+    m_handler->waitForWrites(m_mount, m_nodeId);
+
+    QSqlQuery &qry = query(SqlFileEngineHandler::SelectStat);
+    qry.bindValue(":rowid", m_nodeId);
+    bool found = qry.exec() && qry.next();
+    if (found) {
+        *stat = SqlFsStat(qry, 0);
+        m_mount->insertStat(m_nodeId, *stat);
+    }
+    qry.finish();
+
+    return found;
+}
+
+bool SqlFileEngine::readChunk(SqlBlob *blob, SqlBlob *shared, qint64 idx,
+                              qint64 offset, char *data, qint64 len)
+{
+    qint64 avail = 0;
+
+    if (m_legacy) {
+        offset += idx * ChunkSize;
+        if (!blob->open(m_nodeId))
+            return false;
+        avail = qBound<qint64>(0, blob->size() - offset, len);
+    } else if (!m_truncate || idx <= m_truncateIdx) {
+        ChunkRow row;
+        if (!chunkRow(idx, &row))
+            return false;
+        if (row.encoded) {
+            QByteArray *chunk = cachedChunk(idx);
+            if (!chunk)
+                return false;
+            copyChunk(*chunk, offset, data, len);
+            return true;
+        }
+        if (row.blob >= 0) {
+            blob = shared;
+            if (!blob->open(row.blob))
+                return false;
+            avail = qBound<qint64>(0, blob->size() - offset, len);
+        } else if (row.row >= 0) {
+            if (!blob->open(row.row))
+                return false;
+            avail = qBound<qint64>(0, blob->size() - offset, len);
+        }
+    }
+
+    if (avail > 0 && !blob->read(data, avail, offset))
+        return false;
+    if (avail < len)
+        memset(data + avail, 0, len - avail);
+
+    return true;
+}
+
+bool SqlFileEngine::chunkRow(qint64 idx, ChunkRow *row)
+{
+    QHash<qint64, ChunkRow>::const_iterator it = m_chunkRows.constFind(idx);
+    if (it != m_chunkRows.constEnd()) {
+        *row = it.value();
+        return true;
+    }
+
+    // Look up a window of chunks at once, sequential access is the common
+    // case. Chunks not found are holes.
+    qint64 last = qMax(idx, qMin(idx + ChunkRowWindow, m_size / ChunkSize));
+
+    QSqlQuery &qry = query(SqlFileEngineHandler::SelectChunkRows);
+    qry.bindValue(":node", m_nodeId);
+    qry.bindValue(":first", idx);
+    qry.bindValue(":last", last);
+    if (!qry.exec())
+        return false;
+
+    for (qint64 i = idx; i <= last; i++)
+        m_chunkRows.insert(i, ChunkRow());
+    while (qry.next()) {
+        m_chunkRows.insert(qry.value(0).toLongLong(),
+                           ChunkRow(qry.value(1).toLongLong(), qry.value(2).toLongLong(),
+                                    qry.value(3).toBool()));
+    }
+    qry.finish();
+
+    *row = m_chunkRows.value(idx);
+    return true;
+}
+
+bool SqlFileEngine::loadChunk(qint64 idx, QByteArray *chunk)
+{
+    chunk->clear();
+
+    // Chunk is pending for deletion or beyond the end of the file
+    if ((m_truncate && idx > m_truncateIdx) || idx * ChunkSize >= m_size)
+        return true;
+
+    QSqlQuery &qry = query(m_legacy ? SqlFileEngineHandler::SelectLegacyChunk
+                                    : SqlFileEngineHandler::SelectChunk);
+    if (m_legacy) {
+        qry.bindValue(":offset", idx * ChunkSize + 1);
+        qry.bindValue(":length", ChunkSize);
+        qry.bindValue(":rowid", m_nodeId);
+    } else {
+        qry.bindValue(":node", m_nodeId);
+        qry.bindValue(":idx", idx);
+    }
+
+    if (!qry.exec())
+        return false;
+
+    // A missing chunk is a hole in a sparse file
+    QVariant encoding;
+    if (qry.next()) {
+        *chunk = qry.value(0).toByteArray();
+        if (!m_legacy)
+            encoding = qry.value(1);
+    }
+    qry.finish();
+
+    if (encoding.isNull())
+        return true;
+
+    const SqlFsCodec *codec = m_handler->codec(encoding.toInt());
+    if (!codec) {
+        qWarning("sqlfs: no codec with id %d registered", encoding.toInt());
+        return false;
+    }
+
+    // Encoded chunks are never empty
+    *chunk = codec->decode(*chunk);
+    return !chunk->isEmpty();
+}
+
+QByteArray *SqlFileEngine::cachedChunk(qint64 idx)
+{
+    QHash<qint64, QByteArray>::iterator it = m_chunks.find(idx);
+    if (it != m_chunks.end()) {
+        m_mount->count(SqlFsStatistics::ChunkCacheHits);
+        return &it.value();
+    }
+    m_mount->count(SqlFsStatistics::ChunkCacheMisses);
+
+    // Keep memory bounded, write back what is dirty and start over
+    if (m_chunks.size() >= MaxCachedChunks) {
+        if (!storeChunks())
+            return 0;
+        m_chunks.clear();
+    }
+
+    QByteArray chunk;
+    if (!loadChunk(idx, &chunk))
+        return 0;
+
+    return &m_chunks.insert(idx, chunk).value();
+}
+
+bool SqlFileEngine::storeBehind()
+{
+    SqlFsStat stat;
+    if (!loadStat(&stat))
+        return false;
+
+    SqlFsPendingWrite write;
+    write.connectionName = m_connectionName;
+    write.tableName = m_tableName;
+    write.mount = m_mount;
+    write.node = m_nodeId;
+    write.deduplicate = m_mount->options().deduplicate;
+    write.codec = mountCodec();
+    write.size = m_size;
+    write.truncate = m_truncate;
+    write.truncateIdx = m_truncateIdx;
+    foreach (qint64 idx, m_dirtyChunks.keys())
+        write.chunks.insert(idx, m_chunks.value(idx));
+    write.fullText = m_mount->indexesText();
+    if (write.fullText && !loadText(&write.text))
+        return false;
+    m_handler->writeBehind(write);
+
+    // Stats are served from the queued state until it is written
+    m_mount->unpinAll(m_nodeId);
+    stat.size = m_size;
+    stat.modified = QDateTime::currentDateTimeUtc();
+    m_mount->insertStat(m_nodeId, stat);
+
+    m_truncate = false;
+    m_dirtyChunks.clear();
+    m_modified = false;
+    m_textStale = false;
+    return true;
+}
+
+bool SqlFileEngine::storeChunks()
+{
+    if (!m_truncate && m_dirtyChunks.isEmpty())
+        return true;
+
+    SqlTransaction transaction(m_db);
+
+    if (!writeChunks() || !transaction.commit()) {
+        m_chunkRows.clear();
+        return false;
+    }
+
+    foreach (const DirtyRange &range, m_dirtyChunks)
+        m_storedBytes += range.second - range.first;
+
+    m_truncate = false;
+    m_dirtyChunks.clear();
+    m_mount->removeStat(m_nodeId);
+    return true;
+}
+
+// Text to index for the current content, empty for binary and large files
+bool SqlFileEngine::loadText(QString *text)
+{
+    text->clear();
+    if (!loadMetadata())
+        return false;
+    if (m_size > MaxIndexedFile)
+        return true;
+
+    // Files written as a whole are still buffered, others are read back
+    QByteArray content(m_size, Qt::Uninitialized);
+    bool buffered = true;
+    for (qint64 idx = 0; buffered && idx * ChunkSize < m_size; idx++) {
+        QHash<qint64, QByteArray>::const_iterator it = m_chunks.constFind(idx);
+        if (it == m_chunks.constEnd())
+            buffered = false;
+        else
+            copyChunk(it.value(), 0, content.data() + idx * ChunkSize,
+                      qMin(ChunkSize, m_size - idx * ChunkSize));
+    }
+    if (!buffered && !readAt(0, content.data(), m_size))
+        return false;
+    decodeText(content, text);
+    return true;
+}
+
+bool SqlFileEngine::updateText()
+{
+    if (!m_mount->indexesText())
+        return true;
+
+    QString text;
+    return loadText(&text) && storeText(m_handler, m_db, m_mount, m_tableName, m_nodeId, text);
+}
+
+const SqlFsCodec *SqlFileEngine::mountCodec() const
 {
-    return new SqlFileEngineIterator(this, filters, filterNames);
+    QString name = m_mount->options().compression;
+    if (name.isEmpty())
+        return 0;
+
+    const SqlFsCodec *codec = m_handler->codec(name);
+    if (!codec)
+        qWarning("sqlfs: unknown codec %s, storing raw", qPrintable(name));
+    return codec;
 }
 
-bool SqlFileEngine::open(QIODevice::OpenMode openMode)
+bool SqlFileEngine::writeChunks()
 {
-    if (m_nodeId < 0) {
-        QSqlQuery qry(m_db);
+    if (m_truncate) {
+        QSqlQuery &qry = query(SqlFileEngineHandler::TruncateChunks);
+        qry.bindValue(":node", m_nodeId);
+        qry.bindValue(":idx", m_truncateIdx);
+        if (!qry.exec())
+            return false;
+        m_chunkRows.clear();
+    }
 
-        qry.prepare(QString("INSERT INTO %1 (create_date, parent, flags, name) "
-                            "VALUES (CURRENT_TIMESTAMP, :parent, :flags, :name)")
-                    .arg(m_tableName));
+    if (m_dirtyChunks.isEmpty())
+        return true;
 
-        int parent = node(m_path);
-        if (parent < 0)
-             return false;
+    bool deduplicate = m_mount->options().deduplicate;
+    const SqlFsCodec *codec = mountCodec();
+    SqlBlob blob(m_db, m_legacy ? m_tableName : m_mount->chunkTable(), true);
 
-        qry.bindValue(":parent", parent);
+    QHash<qint64, DirtyRange>::const_iterator it;
+    for (it = m_dirtyChunks.constBegin(); it != m_dirtyChunks.constEnd(); ++it) {
+        qint64 idx = it.key();
+        const DirtyRange &range = it.value();
+        const QByteArray chunk = m_chunks.value(idx);
 
-        qry.bindValue(":flags", static_cast<int>(
-                FileType | ExistsFlag | ReadUserPerm | WriteUserPerm));
-        qry.bindValue(":name", m_fileName);
+        // Legacy rows are only patched in place, they never grow here
+        if (m_legacy) {
+            if (!blob.open(m_nodeId) ||
+                    !blob.write(chunk.constData() + range.first,
+                                range.second - range.first,
+                                idx * ChunkSize + range.first))
+                return false;
+            continue;
+        }
 
-        if (qry.exec()) {
-            m_nodeId = qry.lastInsertId().toInt();
-        } else {
+        // Chunks keeping their size only get the modified range written,
+        // unless they are shared or encoded
+        ChunkRow row;
+        if (blob.isValid() && !deduplicate && !codec && !chunkRow(idx, &row))
             return false;
+        if (row.row >= 0 && row.blob < 0 && !row.encoded && blob.open(row.row) &&
+                blob.size() == chunk.size()) {
+            if (!blob.write(chunk.constData() + range.first,
+                            range.second - range.first, range.first))
+                return false;
+            continue;
         }
+
+        if (!storeChunk(m_handler, m_db, m_mount, m_tableName, m_nodeId, idx, chunk,
+                        deduplicate, codec))
+            return false;
+        m_chunkRows.remove(idx);
     }
 
-    m_openMode = openMode;
+    return true;
+}
 
-    if (openMode & QIODevice::Truncate) {
-        setSize(0);
-        m_pos = 0;
-        return true;
+void SqlFileEngine::markDirty(qint64 idx, int begin, int end)
+{
+    // Ranges are merged, everything in between is written as well
+    QHash<qint64, DirtyRange>::iterator it = m_dirtyChunks.find(idx);
+    if (it == m_dirtyChunks.end()) {
+        m_dirtyChunks.insert(idx, DirtyRange(begin, end));
+    } else {
+        it.value().first = qMin(it.value().first, begin);
+        it.value().second = qMax(it.value().second, end);
     }
+}
+
+bool SqlFileEngine::convertLegacy()
+{
+    QSqlQuery &convert = query(SqlFileEngineHandler::ConvertLegacy);
+    convert.bindValue(":rowid", m_nodeId);
+    if (!convert.exec())
+        return false;
+
+    QSqlQuery &clear = query(SqlFileEngineHandler::ClearData);
+    clear.bindValue(":rowid", m_nodeId);
+    if (!clear.exec())
+        return false;
 
-    return loadFile();
+    // Chunks loaded from the data column are still valid
+    m_legacy = false;
+    m_chunkRows.clear();
+    return true;
 }
 
-bool SqlFileEngine::mkdir(const QString &dirName, bool createParentDirectories) const
+bool SqlFileEngine::transfer(const QString &newName, bool move)
 {
-    Q_UNUSED(createParentDirectories);
+    // The root node of a table is neither moved nor copied
+    QString destConnection;
+    QString destPath;
+    if (m_nodeId < 0 || splitPath(m_filePath).size() < 2 ||
+            !splitUrl(m_handler->stripOptions(QDir::fromNativeSeparators(newName)),
+                      &destConnection, &destPath))
+        return false;
 
-    if (m_urlRegExp.exactMatch(dirName)) {
-        QStringList list = m_urlRegExp.capturedTexts();
+    QSqlDatabase db = m_handler->database(destConnection);
+    if (!db.isValid())
+        return false;
 
+    QStringList list = splitPath(destPath);
+    if (list.size() < 2)
+        return false;
 
-        QSqlDatabase db = QSqlDatabase::database(list[1]);
-        QString path = list[2];
-        list = splitPath(path);
+    QString destTable = list.first();
+    QString destName = list.takeLast();
+    createTable(m_handler, destTable, db);
+    SqlFsMount *destMount = m_handler->mount(db.connectionName(), destTable);
 
-        QString tableName = list.first();
+    int parent = node(list.join('/'), db);
+    if (parent < 0 || child(parent, destName, db, destMount, destTable) >= 0)
+        return false;
 
-        createTable(tableName, db);
+    SqlFsStat stat;
+    if (!loadStat(&stat))
+        return false;
+    bool isDir = stat.flags & DirectoryType;
 
-        // Check if directory already exists
-        if (node(path, db) >= 0)
+    // The result has to include what is still buffered or queued
+    if ((m_modified || m_textStale) && !store(true))
+        return false;
+    m_handler->waitForWrites(m_mount, isDir ? -1 : m_nodeId);
+
+    bool sameConnection = destConnection == m_connectionName;
+    if (sameConnection && destTable == m_tableName) {
+        // A directory can't end up inside of itself
+        if (isDir && inTree(parent))
             return false;
 
-        if (createParentDirectories) {
-            list.removeFirst(); // remove root file
+        if (move) {
+            QSqlQuery &qry = query(SqlFileEngineHandler::MoveNode);
+            qry.bindValue(":parent", parent);
+            qry.bindValue(":name", destName);
+            qry.bindValue(":rowid", m_nodeId);
+            bool ok = qry.exec();
+            m_handler->batchStep(m_db, ok);
+            if (!ok)
+                return false;
 
-            QSqlQuery insQuery(m_db);
-            insQuery.prepare(QString("INSERT INTO %1 (create_date, parent, name, flags) "
-                                "VALUES (CURRENT_TIMESTAMP, :parent, :name, :flags)")
-                        .arg(tableName));
+            // The subtree moves along, it is cached relative to this node
+            m_mount->remove(node(m_path), m_fileName);
+            m_mount->insert(parent, destName, m_nodeId);
+            return true;
+        }
+    }
 
-            QSqlQuery selQuery(m_db);
+    // Other databases are attached to this connection, so the content is
+    // copied by the database as well. SQLite refuses to attach inside of
+    // a transaction, QFile streams the file then.
+    QString destPrefix;
+    if (!sameConnection) {
+        QString fileName = db.databaseName();
+        if (fileName.isEmpty() || fileName == ":memory:" || fileName.contains("mode=memory"))
+            return false;
 
-            int parent = 0;
-            for (int i = 0; i < list.size(); i++) {
-                selQuery.prepare(QString("SELECT rowid "
-                                         "FROM %1 "
-                                         "WHERE parent=:parent AND name=:name")
-                                 .arg(m_tableName));
-                selQuery.bindValue(":parent", parent);
-                insQuery.bindValue(":parent", parent);
-                selQuery.bindValue(":name", list.at(i));
-                selQuery.exec();
-                if (selQuery.next()) {
-                    parent = selQuery.value(0).toInt();
-                } else {
-                    // not found => create
-                    insQuery.bindValue(":name", list.at(i));
-                    insQuery.bindValue(":flags", static_cast<unsigned>(
-                            DirectoryType | ExistsFlag | ReadUserPerm | WriteUserPerm));
-                    insQuery.exec();
-                    parent = insQuery.lastInsertId().toInt();
-                }
-            }
-        } else {
-            // Check for the parent directory to exist otherwise fail
-            QString newDir = list.last();
-            list.removeLast();
+        QSqlQuery attach(m_db);
+        attach.prepare("ATTACH DATABASE :file AS sqlfs_dest");
+        attach.bindValue(":file", fileName);
+        if (!attach.exec())
+            return false;
+        destPrefix = "sqlfs_dest.";
+    }
 
-            int parent = node(list.join('/'), db);
-            if (parent < 0 || newDir.isEmpty())
-                return false;
+    int copied;
+    bool ok;
+    {
+        SqlTransaction transaction(m_db);
+        copied = copyTree(destPrefix + destTable, !sameConnection, parent, destName, move,
+                          destMount->indexesText());
+        ok = copied >= 0 && (!move || deleteTree(m_nodeId, m_db, m_mount, m_tableName)) &&
+                transaction.commit();
+    }
 
-            QSqlQuery qry(db);
-            qry.prepare(QString("INSERT INTO %1 (create_date, parent, name, flags) "
-                                "VALUES (CURRENT_TIMESTAMP, :parent, :name, :flags)")
-                        .arg(tableName));
-            qry.bindValue(":parent", parent);
-            qry.bindValue(":name", newDir);
-            qry.bindValue(":flags", static_cast<unsigned>(
-                    DirectoryType | ExistsFlag | ReadUserPerm | WriteUserPerm));
+    if (!sameConnection) {
+        QSqlQuery detach(m_db);
+        if (!detach.exec("DETACH DATABASE sqlfs_dest"))
+            qWarning("sqlfs: could not detach %s", qPrintable(db.databaseName()));
+    }
 
-            return qry.exec();
-        }
+    m_handler->batchStep(m_db, ok);
+    if (!ok)
+        return false;
 
+    destMount->insert(parent, destName, copied);
+    if (isDir)
+        destMount->dropIndex();
+    if (move) {
+        m_handler->scheduleVacuum(m_connectionName, m_tableName);
+        if (isDir) {
+            m_mount->clear();
+        } else {
+            m_mount->remove(node(m_path), m_fileName);
+            m_mount->removeStat(m_nodeId);
+        }
+        m_nodeId = -1;
     }
+
     return true;
 }
 
-bool SqlFileEngine::rmdir(const QString &dirName, bool recurseParentDirectories) const
+int SqlFileEngine::copyTree(const QString &destTable, bool attached, int parent,
+                            const QString &name, bool move, bool text) const
 {
-    m_urlRegExp.exactMatch(QDir::fromNativeSeparators(dirName));
-    QStringList list = m_urlRegExp.capturedTexts();
+    // Statements on an attached database name the source tables explicitly
+    QString tableName = attached ? "main." + m_tableName : m_tableName;
+    bool sameTable = tableName == destTable;
 
-    QSqlDatabase db = QSqlDatabase::database(list[1]);
-
-    QString filePath  = list[2];
-    list = splitPath(list[2]);
+    // The copies get consecutive rowids behind the last row of the
+    // destination, mapped from the originals by a temporary table. Gaps
+    // between the originals are not copied, ids only grow by the number of
+    // copied nodes.
+    QSqlQuery qry(m_db);
+    if (!qry.exec("CREATE TEMP TABLE IF NOT EXISTS sqlfs_copy "
+                  "(new INTEGER PRIMARY KEY, old INTEGER UNIQUE)") ||
+            !qry.exec("DELETE FROM temp.sqlfs_copy"))
+        return -1;
 
-    QString tableName = list.first();
+    QStringList statements;
+    statements << "INSERT INTO temp.sqlfs_copy (new, old) "
+                  "SELECT COALESCE(MAX(rowid), 0) + 1, :root FROM %4"
+               << "INSERT INTO temp.sqlfs_copy (old) SELECT id FROM tree WHERE id<>:top";
+    foreach (const QString &statement, statements) {
+        qry.prepare(treeSql(statement, tableName, destTable));
+        qry.bindValue(":node", m_nodeId);
+        qry.bindValue(statement.contains(":root") ? ":root" : ":top", m_nodeId);
+        if (!qry.exec())
+            return -1;
+    }
 
-    int nodeId = node(filePath, db);
+    // Node ids are ints, a copy behind the largest one can't be addressed
+    if (!qry.exec("SELECT MIN(new), MAX(new) FROM temp.sqlfs_copy") || !qry.next())
+        return -1;
+    if (qry.value(1).toLongLong() > INT_MAX) {
+        qWarning("sqlfs: no node ids left in %s", qPrintable(destTable));
+        return -1;
+    }
+    int copied = qry.value(0).toInt();
+    qry.finish();
 
-    if (nodeId < 0)
-        return false;
+    // Copies are new files, moves keep their dates
+    QString dates = move ? "n.create_date, n.write_date"
+                         : "CURRENT_TIMESTAMP, CURRENT_TIMESTAMP";
 
-    QSqlQuery qry(db);
+    statements.clear();
+    statements << "INSERT INTO %4 (rowid, create_date, write_date, parent, name, flags, size, data) "
+                  "SELECT m.new, " + dates + ", "
+                  "CASE WHEN n.rowid=:root THEN :parent ELSE p.new END, "
+                  "CASE WHEN n.rowid=:top THEN :name ELSE n.name END, "
+                  "n.flags, n.size, n.data FROM temp.sqlfs_copy m "
+                  "JOIN %1 n ON n.rowid=m.old "
+                  "LEFT JOIN temp.sqlfs_copy p ON p.old=n.parent";
 
-    if (!recurseParentDirectories) {
-        qry.prepare(QString("SELECT COUNT(*) FROM %1 WHERE parent=:parent")
-                    .arg(tableName));
-        qry.bindValue(":parent", nodeId);
-        if (!(qry.exec() && qry.next() && qry.value(0).toInt() == 0))
-            return false;
+    if (sameTable) {
+        // Deduplicated chunks are copied by reference
+        statements << "INSERT INTO %5 (node, idx, data, blob, encoding, length) "
+                      "SELECT m.new, c.idx, c.data, c.blob, c.encoding, c.length "
+                      "FROM temp.sqlfs_copy m JOIN %2 c ON c.node=m.old";
+    } else {
+        // Blob tables are per table, shared chunks are matched by hash
+        statements << "INSERT OR IGNORE INTO %6 (hash, data) "
+                      "SELECT hash, data FROM %3 "
+                      "WHERE rowid IN (SELECT blob FROM %2 WHERE node IN tree)"
+                   << "INSERT INTO %5 (node, idx, data, blob, encoding, length) "
+                      "SELECT m.new, c.idx, c.data, "
+                      "(SELECT d.rowid FROM %6 d JOIN %3 b ON d.hash=b.hash "
+                      "WHERE b.rowid=c.blob), "
+                      "c.encoding, c.length FROM temp.sqlfs_copy m JOIN %2 c ON c.node=m.old";
     }
 
-    qry.prepare(QString("DELETE FROM %1 WHERE rowid=:rowid")
-                .arg(tableName));
-    qry.bindValue(":rowid", nodeId);
-    return qry.exec();
-}
+    // Indexed text goes along, %7 and %8 are the text tables of the source
+    // and the destination
+    bool indexed = m_mount->indexesText();
+    if (text && indexed) {
+        statements << "INSERT INTO %8 (rowid, content) "
+                      "SELECT m.new, t.content FROM temp.sqlfs_copy m "
+                      "JOIN %7 t ON t.rowid=m.old";
+    }
 
-bool SqlFileEngine::remove()
-{
-    if (m_nodeId >= 0) {
-        QSqlQuery qry(m_db);
-        qry.prepare(QString("DELETE FROM %1 WHERE rowid=:rowid")
-                    .arg(m_tableName));
-        qry.bindValue(":rowid", m_nodeId);
-        return qry.exec();
+    foreach (const QString &statement, statements) {
+        QString sql = treeSql(statement, tableName, destTable)
+                .replace("%7", textTableName(tableName))
+                .replace("%8", textTableName(destTable));
+        qry.prepare(sql);
+        qry.bindValue(":node", m_nodeId);
+        if (sql.contains(":root")) {
+            qry.bindValue(":root", m_nodeId);
+            qry.bindValue(":parent", parent);
+            qry.bindValue(":top", m_nodeId);
+            qry.bindValue(":name", name);
+        }
+        if (!qry.exec())
+            return -1;
     }
-    return false;
+
+    // Files of a source without text index are indexed like by
+    // SqlFileEngineHandler::createFullText(), from this connection as the
+    // destination is locked by the transaction
+    if (text && !indexed && !indexCopies(destTable))
+        return -1;
+
+    if (!qry.exec("DELETE FROM temp.sqlfs_copy"))
+        return -1;
+    return copied;
 }
 
-bool SqlFileEngine::rename(const QString &newName)
+bool SqlFileEngine::indexCopies(const QString &destTable) const
 {
-    if (m_nodeId < 0)
+    QSqlQuery qry(m_db);
+    qry.prepare(QString("WITH RECURSIVE paths(id, path) AS ("
+                        "SELECT :node, '' "
+                        "UNION ALL "
+                        "SELECT n.rowid, paths.path || '/' || n.name "
+                        "FROM %1 n JOIN paths ON n.parent=paths.id) "
+                        "SELECT t.path, m.new FROM paths t "
+                        "JOIN %1 n ON n.rowid=t.id "
+                        "JOIN temp.sqlfs_copy m ON m.old=t.id "
+                        "WHERE (n.flags & :directory)=0 AND COALESCE(n.size, 0)<=:size")
+                .arg(m_tableName));
+    qry.bindValue(":node", m_nodeId);
+    qry.bindValue(":directory", static_cast<int>(DirectoryType));
+    qry.bindValue(":size", MaxIndexedFile);
+    if (!qry.exec())
         return false;
 
-    if (m_urlRegExp.exactMatch(QDir::fromNativeSeparators(newName))) {
-        QStringList list = m_urlRegExp.capturedTexts();
-
-        QSqlDatabase db = QSqlDatabase::database(list[1]);
+    QString prefix = m_absoluteFileName;
+    if (prefix.endsWith('/'))
+        prefix.chop(1);
+    QList<QPair<QString, qint64> > files;
+    while (qry.next())
+        files.append(qMakePair(qry.value(0).toString(), qry.value(1).toLongLong()));
+    qry.finish();
 
-        QString filePath  = list[2];
-        list = splitPath(filePath);
-
-        QString tableName = list.first();
-        list.removeLast();
-        QString destPath = list.join('/');
+    QSqlQuery insert(m_db);
+    insert.prepare(QString("INSERT INTO %1 (rowid, content) VALUES (:node, :content)")
+                   .arg(textTableName(destTable)));
+    for (int i = 0; i < files.size(); i++) {
+        SqlFileEngine file(prefix + files.at(i).first, m_handler);
+        QString content;
+        if (!file.open(QIODevice::ReadOnly) || !file.loadText(&content))
+            return false;
+        file.close();
+        if (content.isEmpty())
+            continue;
 
-        QSqlQuery qry(db);
-        int parent = node(destPath);
-        if (parent < 0)
+        insert.bindValue(":node", files.at(i).second);
+        insert.bindValue(":content", content);
+        if (!insert.exec())
             return false;
-        qry.prepare(QString("UPDATE %1 SET parent=:parent WHERE rowid=:rowid")
-                    .arg(tableName));
-        qry.bindValue(":parent", parent);
+    }
+    return true;
+}
 
-        qry.bindValue(":rowid", m_nodeId);
-        return qry.exec();
-    } else {
-        // Copy out of our virtual file system
+bool SqlFileEngine::deleteTree(int node, QSqlDatabase db, SqlFsMount *mount,
+                               const QString &tableName) const
+{
+    // Chunks and text first, they are found through the nodes
+    QSqlQuery &chunks = query(SqlFileEngineHandler::DeleteTreeChunks, db, mount, tableName);
+    chunks.bindValue(":node", node);
+    if (!chunks.exec())
+        return false;
 
+    if (mount->indexesText()) {
+        QSqlQuery &text = query(SqlFileEngineHandler::DeleteTreeText, db, mount, tableName);
+        text.bindValue(":node", node);
+        if (!text.exec())
+            return false;
     }
 
-    return false;
+    QSqlQuery &nodes = query(SqlFileEngineHandler::DeleteTree, db, mount, tableName);
+    nodes.bindValue(":node", node);
+    return nodes.exec();
 }
 
-qint64 SqlFileEngine::size() const
+bool SqlFileEngine::inTree(int node) const
 {
-    return m_buffer.size();
+    QSqlQuery qry(m_db);
+    qry.prepare(treeSql("SELECT COUNT(*) FROM tree WHERE id=:id", m_tableName, m_tableName));
+    qry.bindValue(":node", m_nodeId);
+    qry.bindValue(":id", node);
+    return qry.exec() && qry.next() && qry.value(0).toInt() > 0;
 }
 
-bool SqlFileEngine::setSize(qint64 size)
+uchar *SqlFileEngine::mapRegion(qint64 offset, qint64 size, QFile::MemoryMapFlags flags)
 {
-    m_buffer.resize(size);
-    return true;
-}
+    if (m_openMode == QIODevice::NotOpen || offset < 0 || size <= 0 ||
+            !loadMetadata() || offset + size > m_size)
+        return 0;
 
-bool SqlFileEngine::seek(qint64 pos)
-{
-    if (pos < m_buffer.size()) {
-        m_pos = pos;
-        return true;
+    // Writes through shared memory would never reach the database
+    bool copy = flags & QFile::MapPrivateOption;
+    if ((m_openMode & QIODevice::WriteOnly) && !copy)
+        return 0;
+
+    Mapping mapping;
+    uchar *address;
+    if (!copy && !m_modified && m_size <= MaxSharedMapping) {
+        // Loaded as a whole once, all engines map the same buffer
+        mapping.node = m_nodeId;
+        mapping.content = m_mount->pin(m_nodeId);
+        if (mapping.content.isNull()) {
+            QByteArray content(m_size, Qt::Uninitialized);
+            if (!readAt(0, content.data(), m_size))
+                return 0;
+            mapping.content = m_mount->pin(m_nodeId, content);
+        }
+        address = reinterpret_cast<uchar *>(const_cast<char *>(
+                mapping.content.constData())) + offset;
+    } else {
+        mapping.node = -1;
+        mapping.content.resize(size);
+        if (!readAt(offset, mapping.content.data(), size))
+            return 0;
+        address = reinterpret_cast<uchar *>(mapping.content.data());
     }
 
-    return false;
+    m_mappings.insertMulti(address, mapping);
+    return address;
 }
 
-qint64 SqlFileEngine::write(const char *data, qint64 len)
+bool SqlFileEngine::unmapRegion(uchar *address)
 {
-    if (m_openMode & (QIODevice::ReadWrite | QIODevice::WriteOnly)) {
-        if (len + m_pos > size()) {
-            setSize(m_pos + len);
-        }
-        m_buffer.replace(m_pos, len, data, len);
-        m_pos += len;
-    } else {
-        len = -1;
-    }
+    if (!m_mappings.contains(address))
+        return false;
 
-    return len;
+    Mapping mapping = m_mappings.take(address);
+    if (mapping.node >= 0)
+        m_mount->unpin(mapping.node, mapping.content);
+    return true;
 }
 
-qint64 SqlFileEngine::read(char *data, qint64 maxlen)
+bool SqlFileEngine::readAt(qint64 pos, char *data, qint64 len)
 {
-    qint64 len = qMin<qint64>(m_buffer.size() - m_pos, maxlen);
-    memcpy(data + m_pos, m_buffer.data(), len);
-    m_pos += len;
-    return len;
+    qint64 oldPos = m_pos;
+    m_pos = pos;
+    bool ok = read(data, len) == len;
+    m_pos = oldPos;
+    return ok;
 }
 
-bool SqlFileEngine::flush()
+bool SqlFileEngine::splitUrl(const QString &url, QString *connectionName, QString *path)
 {
-    QSqlQuery qry(m_db);
-    qry.prepare(QString("UPDATE %1 SET write_date=CURRENT_TIMESTAMP, "
-                        "data=:data "
-                        "WHERE rowid=:rowid")
-                .arg(m_tableName));
+    // sql:/<connection>/<path>
+    if (!url.startsWith(QLatin1String("sql:/")))
+        return false;
 
-    qry.bindValue(":rowid", m_nodeId);
-    qry.bindValue(":data", m_buffer);
-    return qry.exec();
+    int slash = url.indexOf('/', 5);
+    if (slash <= 5)
+        return false;
+
+    *connectionName = url.mid(5, slash - 5);
+    *path = url.mid(slash + 1);
+    return true;
 }
 
-bool SqlFileEngine::close()
+QStringList SqlFileEngine::splitPath(const QString &path) const
 {
-    return flush();
+    QStringList list = path.split('/');
+    list.removeAll("");
+    return list;
 }
 
-bool SqlFileEngine::loadFile()
+void SqlFileEngine::loadIndex() const
 {
-    QSqlQuery qry(m_db);
-    qry.prepare(QString("SELECT data FROM %1 WHERE rowid=:rowid")
-                .arg(m_tableName));
-    qry.bindValue(":rowid", m_nodeId);
-    if (qry.exec() && qry.next()) {
-        m_buffer = qry.value(0).toByteArray();
-        m_pos = 0;
-        return true;
+    QSqlQuery &version = query(SqlFileEngineHandler::SelectDataVersion);
+    if (!version.exec() || !version.next())
+        return;
+    qint64 dataVersion = version.value(0).toLongLong();
+    version.finish();
+
+    quint64 generation;
+    qint64 indexChanges;
+    if (m_mount->checkIndex(m_db.connectionName(), dataVersion, &generation, &indexChanges))
+        return;
+
+    // Connections new to the index only see whether the table changed
+    // since it was built through the change counter
+    QSqlQuery &changes = query(SqlFileEngineHandler::SelectChanges);
+    changes.bindValue(":name", m_tableName);
+    if (indexChanges >= 0 && changes.exec() && changes.next() &&
+            changes.value(0).toLongLong() == indexChanges) {
+        changes.finish();
+        if (m_mount->validateIndex(m_db.connectionName(), dataVersion, generation))
+            return;
     }
-    return false;
+    changes.finish();
+
+    // Sizes of queued contents are only known once they are written, which
+    // changes the data version again
+    m_handler->waitForWrites(m_mount);
+
+    // Version, counter and rows come from the same snapshot
+    SqlTransaction transaction(m_db);
+    if (!version.exec() || !version.next())
+        return;
+    dataVersion = version.value(0).toLongLong();
+    version.finish();
+
+    changes.bindValue(":name", m_tableName);
+    if (!changes.exec())
+        return;
+    qint64 tableChanges = changes.next() ? changes.value(0).toLongLong() : -1;
+    changes.finish();
+
+    QSqlQuery &qry = query(SqlFileEngineHandler::SelectIndex);
+    if (!qry.exec())
+        return;
+
+    QHash<int, QMap<QString, int> > tree;
+    QHash<int, SqlFsStat> stats;
+    while (qry.next()) {
+        int node = qry.value(0).toInt();
+        int parent = qry.value(1).isNull() ? -1 : qry.value(1).toInt();
+        tree[parent].insert(qry.value(2).toString(), node);
+        stats.insert(node, SqlFsStat(qry, 3));
+    }
+    qry.finish();
+    transaction.commit();
+
+    m_mount->setIndex(tree, stats, tableChanges, m_db.connectionName(), dataVersion,
+                      generation);
 }
 
-QStringList SqlFileEngine::splitPath(const QString &path) const
+bool SqlFileEngine::createTable(const SqlFileEngineHandler *handler,
+                                const QString &tableName, QSqlDatabase db)
 {
-    QStringList list = path.split('/');
-    list.removeAll("");
-    return list;
+    SqlFsMount *mount = handler->mount(db.connectionName(), tableName);
+    bool valid;
+    if (mount->isChecked(&valid))
+        return valid;
+
+    // Schema versions of all file system tables in a database
+    QSqlQuery qry(db);
+    qry.exec("CREATE TABLE IF NOT EXISTS sqlfs_meta ("
+             "name TEXT PRIMARY KEY, "
+             "version INT, "
+             "changes INT NOT NULL DEFAULT 0"
+             ")");
+
+    qry.prepare("SELECT version FROM sqlfs_meta WHERE name=:name");
+    qry.bindValue(":name", tableName);
+    int version = qry.exec() && qry.next() ? qry.value(0).toInt() : 0;
+    qry.finish();
+
+    valid = version >= SchemaVersion || migrateTable(tableName, db, version);
+    if (!valid)
+        qWarning() << "sqlfs: could not migrate table" << tableName
+                   << "from version" << version;
+
+    // Path lookups are done by the database if it supports recursive queries
+    qry.exec("SELECT sqlite_version()");
+    QStringList sqliteVersion = qry.next() ? qry.value(0).toString().split('.')
+                                           : QStringList();
+    qry.finish();
+    int versionNumber = sqliteVersion.value(0).toInt() * 1000000
+            + sqliteVersion.value(1).toInt() * 1000
+            + sqliteVersion.value(2).toInt();
+
+    mount->setChecked(valid, versionNumber >= 3008003);
+    return valid;
 }
 
-void SqlFileEngine::createTable(const QString &tableName, QSqlDatabase db) const
+bool SqlFileEngine::migrateTable(const QString &tableName, QSqlDatabase db,
+                                 int version)
 {
-    QSqlQuery qry(m_db);
-    qry.exec(QString("CREATE TABLE IF NOT EXISTS %1 ("
-                "create_date INT, "
-                "write_date INT, "
-                "parent INT, "
-                "name TEXT, "
-                "flags INT, "
-                "data BLOB, "
-                "FOREIGN KEY(parent) REFERENCES %1(rowid) ON DELETE CASCADE"
-                ")").arg(tableName));
-    bool ok = qry.exec();
-
-    // We use this dummy root entry to avoid messing around with multiple
-    // queries for NULL value handling. So NULL becomes 0
-    qry.prepare(QString("INSERT OR IGNORE INTO %1 (rowid, parent, flags, name) "
-                        "VALUES (0, NULL, :flags, :name)")
-                .arg(tableName));
-    qry.bindValue(":flags", static_cast<int>(
-            DirectoryType | ExistsFlag | ReadUserPerm | WriteUserPerm));
+    SqlTransaction transaction(db);
+    QSqlQuery qry(db);
+
+    // Version 0 are tables created by earlier versions or not at all
+    if (version < 1) {
+        qry.exec(QString("CREATE TABLE IF NOT EXISTS %1 ("
+                    "create_date INT, "
+                    "write_date INT, "
+                    "parent INT, "
+                    "name TEXT, "
+                    "flags INT, "
+                    "data BLOB, "
+                    "FOREIGN KEY(parent) REFERENCES %1(rowid) ON DELETE CASCADE"
+                    ")").arg(tableName));
+
+        qry.exec(QString("CREATE TABLE IF NOT EXISTS %1 ("
+                    "node INT, "
+                    "idx INT, "
+                    "data BLOB, "
+                    "PRIMARY KEY(node, idx)"
+                    ")").arg(chunkTableName(tableName)));
+
+        // We use this dummy root entry to avoid messing around with multiple
+        // queries for NULL value handling. So NULL becomes 0
+        qry.prepare(QString("INSERT OR IGNORE INTO %1 (rowid, parent, flags, name) "
+                            "VALUES (0, NULL, :flags, :name)")
+                    .arg(tableName));
+        qry.bindValue(":flags", static_cast<int>(
+                DirectoryType | ExistsFlag | ReadUserPerm | WriteUserPerm));
+        qry.bindValue(":name", tableName);
+        if (!qry.exec())
+            return false;
+
+        // Every path component is looked up by (parent, name). Tables of
+        // earlier versions may contain duplicates, these keep a plain index.
+        if (!qry.exec(QString("CREATE UNIQUE INDEX IF NOT EXISTS %1_parent_name "
+                              "ON %1 (parent, name)").arg(tableName))) {
+            qWarning() << "sqlfs: duplicate names in table" << tableName;
+            if (!qry.exec(QString("CREATE INDEX IF NOT EXISTS %1_parent_name "
+                                  "ON %1 (parent, name)").arg(tableName)))
+                return false;
+        }
+    }
+
+    // Version 2 stores the size with the node, stat calls never have to
+    // look at the content.
+    if (version < 2) {
+        if (!qry.exec(QString("ALTER TABLE %1 ADD COLUMN size INT").arg(tableName)))
+            return false;
+
+        if (!qry.exec(QString("UPDATE %1 SET size=COALESCE("
+                              "(SELECT idx * %3 + length(data) FROM %2 "
+                              "WHERE node=%1.rowid ORDER BY idx DESC LIMIT 1), "
+                              "length(data), 0)")
+                      .arg(tableName)
+                      .arg(chunkTableName(tableName))
+                      .arg(ChunkSize)))
+            return false;
+    }
+
+    // Version 3 adds the blob table for deduplicated chunks, the triggers
+    // count the chunks referencing a blob and drop unreferenced ones.
+    if (version < 3) {
+        QString chunkTable = chunkTableName(tableName);
+        QString blobTable = blobTableName(tableName);
+
+        if (!qry.exec(QString("ALTER TABLE %1 ADD COLUMN blob INT").arg(chunkTable)))
+            return false;
+
+        if (!qry.exec(QString("CREATE TABLE IF NOT EXISTS %1 ("
+                              "hash BLOB NOT NULL UNIQUE, "
+                              "refs INT NOT NULL DEFAULT 0, "
+                              "data BLOB"
+                              ")").arg(blobTable)))
+            return false;
+
+        QStringList triggers;
+        triggers << QString("CREATE TRIGGER IF NOT EXISTS %1_insert AFTER INSERT ON %1 "
+                            "WHEN new.blob IS NOT NULL BEGIN "
+                            "UPDATE %2 SET refs=refs+1 WHERE rowid=new.blob; "
+                            "END")
+                    << QString("CREATE TRIGGER IF NOT EXISTS %1_update AFTER UPDATE OF blob ON %1 "
+                               "BEGIN "
+                               "UPDATE %2 SET refs=refs+1 WHERE rowid=new.blob; "
+                               "UPDATE %2 SET refs=refs-1 WHERE rowid=old.blob; "
+                               "DELETE FROM %2 WHERE rowid=old.blob AND refs<=0; "
+                               "END")
+                    << QString("CREATE TRIGGER IF NOT EXISTS %1_delete AFTER DELETE ON %1 "
+                               "WHEN old.blob IS NOT NULL BEGIN "
+                               "UPDATE %2 SET refs=refs-1 WHERE rowid=old.blob; "
+                               "DELETE FROM %2 WHERE rowid=old.blob AND refs<=0; "
+                               "END");
+        foreach (const QString &trigger, triggers) {
+            if (!qry.exec(trigger.arg(chunkTable, blobTable)))
+                return false;
+        }
+    }
+
+    // Version 4 records the codec of encoded chunks and their decoded
+    // length, NULL for raw chunks.
+    if (version < 4) {
+        QString chunkTable = chunkTableName(tableName);
+        if (!qry.exec(QString("ALTER TABLE %1 ADD COLUMN encoding INT").arg(chunkTable)) ||
+                !qry.exec(QString("ALTER TABLE %1 ADD COLUMN length INT").arg(chunkTable)))
+            return false;
+    }
+
+    // Version 5 counts changes of the node table in sqlfs_meta, watchers
+    // compare the count after commits of other connections. Every content
+    // change updates the size and date of its node as well.
+    if (version < 5) {
+        if (!qry.exec("SELECT changes FROM sqlfs_meta LIMIT 0") &&
+                !qry.exec("ALTER TABLE sqlfs_meta ADD COLUMN changes INT NOT NULL DEFAULT 0"))
+            return false;
+
+        foreach (const QString &event, QStringList() << "insert" << "update" << "delete") {
+            if (!qry.exec(QString("CREATE TRIGGER IF NOT EXISTS %1_changes_%2 "
+                                  "AFTER %2 ON %1 BEGIN "
+                                  "UPDATE sqlfs_meta SET changes=changes+1 WHERE name='%1'; "
+                                  "END").arg(tableName, event)))
+                return false;
+        }
+    }
+
+    qry.prepare("INSERT OR REPLACE INTO sqlfs_meta (name, version, changes) "
+                "VALUES (:name, :version, "
+                "COALESCE((SELECT changes FROM sqlfs_meta WHERE name=:existing), 0))");
+    qry.bindValue(":existing", tableName);
     qry.bindValue(":name", tableName);
-    ok = qry.exec();
+    qry.bindValue(":version", static_cast<int>(SchemaVersion));
+    if (!qry.exec())
+        return false;
+
+    return transaction.commit();
 }
 
 int SqlFileEngine::node(const QString &path, QSqlDatabase db) const
 {
-    QSqlQuery qry;
-    if (db.isValid())
-        qry = QSqlQuery(db);
-    else
-        qry = QSqlQuery(m_db);
-
-    /* Plan A was to let the db do the recursive lookup if nodes by path strings.
-     * Unfortunately this is only supported since sqlite 3.8.3 so we do it
-     * manually here. May this snippet can be useful in the future so we kept it.
-    WITH RECURSIVE parsed(p, l, r, n) AS (
-        SELECT NULL, '', 'dir1/dir2/dir3', 0
-        UNION ALL
-        SELECT (SELECT rowid FROM script_fs WHERE (parent IS NULL OR parent = p)
-                AND name=(CASE WHEN INSTR(r, '/')=0 THEN r ELSE SUBSTR(r, 0, INSTR(r, '/')) END) ),
-            l || CASE WHEN INSTR(r, '/')=0 THEN r ELSE SUBSTR(r, 0, INSTR(r, '/') + 1) END,
-            CASE WHEN INSTR(r, '/')=0 THEN NULL ELSE SUBSTR(r, INSTR(r, '/')+1) END, n+1
-        FROM parsed
-        WHERE r IS NOT NULL AND n < 9
-    )
-    SELECT *
-    FROM parsed
-    */
-
+    if (!db.isValid())
+        db = m_db;
 
     QStringList list = splitPath(path);
+    if (list.isEmpty())
+        return -1;
+
+    // Most lookups are on the engine's own mount
     QString tableName = list.first();
+    SqlFsMount *mount = tableName == m_tableName && db.connectionName() == m_db.connectionName()
+            ? m_mount : m_handler->mount(db.connectionName(), tableName);
+    mount->count(SqlFsStatistics::Lookups);
+    mount->count(SqlFsStatistics::LookupSteps, list.size() - 1);
 
-    int parent = -1;
-    for (int i = 0; i < list.size(); i++) {
-        if (parent < 0) {
-            qry.prepare(QString("SELECT rowid "
-                                "FROM %1 "
-                                "WHERE parent IS NULL AND name=:name")
-                        .arg(tableName));
+    // Walk the cached part of the path
+    int parent = child(-1, tableName, db, mount, tableName);
+    int i = 1;
+    for (; parent >= 0 && i < list.size(); i++) {
+        int node;
+        if (!mount->lookup(parent, list.at(i), &node))
+            break;
+        parent = node;
+    }
 
-        } else {
-            qry.prepare(QString("SELECT rowid "
-                                "FROM %1 "
-                                "WHERE parent=:parent AND name=:name")
-                        .arg(tableName));
-            qry.bindValue(":parent", parent);
-        }
+    if (parent < 0 || i == list.size())
+        return parent;
 
-        qry.bindValue(":name", list.at(i));
+    if (!mount->recursiveLookup()) {
+        for (; parent >= 0 && i < list.size(); i++)
+            parent = child(parent, list.at(i), db, mount, tableName);
+        return parent;
+    }
 
-        if (!qry.exec() || !qry.next()) {
-            parent = -1;
-            break;
-        }
-        parent = qry.value(0).toInt();
+    // Let the database resolve the rest in one statement
+    QSqlQuery &qry = query(SqlFileEngineHandler::SelectPath, db, mount, tableName);
+    qry.bindValue(":parent", parent);
+    qry.bindValue(":path", QStringList(list.mid(i)).join('/') + '/');
+    if (!qry.exec())
+        return -1;
+
+    while (parent >= 0 && i < list.size() && qry.next()) {
+        int node = qry.value(1).isNull() ? -1 : qry.value(1).toInt();
+        mount->insert(parent, list.at(i), node);
+        parent = node;
+        i++;
     }
+    qry.finish();
+
+    return i == list.size() ? parent : -1;
+}
+
+int SqlFileEngine::child(int parent, const QString &name, QSqlDatabase db,
+                         SqlFsMount *mount, const QString &tableName) const
+{
+    int node;
+    if (mount->lookup(parent, name, &node))
+        return node;
 
-    return parent;
+    QSqlQuery &qry = query(parent < 0 ? SqlFileEngineHandler::SelectRoot
+                                      : SqlFileEngineHandler::SelectChild,
+                           db, mount, tableName);
+    if (parent >= 0)
+        qry.bindValue(":parent", parent);
+    qry.bindValue(":name", name);
+
+    if (!qry.exec())
+        return -1;
+
+    // Misses are cached as well, most lookups probe for optional files
+    node = qry.next() ? qry.value(0).toInt() : -1;
+    qry.finish();
+    mount->insert(parent, name, node);
+
+    return node;
 }
 
+QSqlQuery &SqlFileEngine::query(SqlFileEngineHandler::Statement statement) const
+{
+    return m_handler->query(m_db, m_tableName, statement, m_mount);
+}
 
+QSqlQuery &SqlFileEngine::query(SqlFileEngineHandler::Statement statement,
+                                const QSqlDatabase &db, SqlFsMount *mount,
+                                const QString &tableName) const
+{
+    return m_handler->query(db, tableName, statement, mount);
+}
@@ -26,26 +26,564 @@
 #define SQLITEFILEENGINE_H
 
 #include <QSqlDatabase>
-#include <QRegExp>
+#include <QSqlQuery>
+#include <QSqlDriver>
+#include <QHash>
+#include <QSet>
+#include <QPair>
+#include <QMutex>
+#include <QVector>
+#include <QElapsedTimer>
+#include <QThreadStorage>
+#include <QFuture>
+#include <QDir>
+#include <QLoggingCategory>
+#include <QDateTime>
+#include <QObject>
+#include <QPointer>
 
 #include "QtCore/private/qabstractfileengine_p.h"
 
+class SqlBlob;
+class SqlFsMount;
+struct SqlFsStat;
+struct SqlFsBatchState;
+class SqlFsThreadConnections;
+class SqlFsWriter;
+struct SqlFsPendingWrite;
+class SqlFsAsync;
+class SqlFsRequest;
+class SqlFsVacuumRequest;
+class QTimer;
+
+// Slow operations and statistics of released mounts are logged to "sqlfs",
+// executions of statements prepared while "sqlfs.query" is enabled to that.
+// Both are off by default, QT_LOGGING_RULES="sqlfs.query.debug=true" enables
+// tracing.
+Q_DECLARE_LOGGING_CATEGORY(lcSqlFs)
+Q_DECLARE_LOGGING_CATEGORY(lcSqlFsQuery)
+
+/*
+ * Tuning of a mount, set through SqlFileEngineHandler::setMountOptions()
+ * or as query on the table name of an URL, which also applies to all
+ * paths below it:
+ *
+ *     sql:/fsdb/files?journal_mode=WAL&synchronous=NORMAL&flush=close/a.txt
+ *
+ * Pragmas left empty or zero keep SQLite's defaults. They apply to the
+ * whole connection, page_size and auto_vacuum only take effect on new
+ * databases or with the next SqlFileEngineHandler::vacuum().
+ */
+struct SqlFsMountOptions
+{
+    enum FlushPolicy {
+        // Every flush() writes through to the database
+        FlushAlways,
+        // Contents are written on close() and chunk cache eviction only
+        FlushOnClose,
+        // flush() writes at most once every flushInterval milliseconds
+        FlushTimed
+    };
+
+    SqlFsMountOptions();
+
+    bool operator==(const SqlFsMountOptions &other) const;
+    bool operator!=(const SqlFsMountOptions &other) const;
+
+    // Parses URL query items like journal_mode=WAL&flush=timed, keys are
+    // the member names below, flush is always, close or timed.
+    bool parse(const QString &query);
+
+    QString journalMode;
+    QString synchronous;
+    qint64 mmapSize;
+    int cacheSize;
+    int pageSize;
+    FlushPolicy flushPolicy;
+    int flushInterval;
+    // close() queues contents for the writer thread of the handler
+    bool writeBehind;
+    // Chunks are written to a blob table shared by identical content
+    bool deduplicate;
+    // Name of the codec new chunks are encoded with, empty stores them raw
+    QString compression;
+    // NONE, FULL or INCREMENTAL. Incremental databases get vacuumPages
+    // pages freed on the handler's thread after deletions, 0 frees all.
+    QString autoVacuum;
+    int vacuumPages;
+    // The whole tree is kept in memory and answers lookups, stats and
+    // listings. Changes by other connections are noticed by their
+    // PRAGMA data_version and reload it.
+    bool preload;
+    // Text files up to SqlFileEngine::MaxIndexedFile are kept in an FTS5
+    // index in <table>_text for SqlFileEngineHandler::search()
+    bool fullText;
+};
+
+/*
+ * Encoding of stored chunks. The id is recorded with every chunk, so it
+ * must never change once chunks have been written with it. zlib with id
+ * 1 is always available.
+ */
+class SqlFsCodec
+{
+public:
+    virtual ~SqlFsCodec() {}
+
+    virtual int id() const = 0;
+    virtual QString name() const = 0;
+    virtual QByteArray encode(const QByteArray &data) const = 0;
+    // Returns an empty QByteArray if data is corrupt, only chunks which
+    // are not empty are encoded.
+    virtual QByteArray decode(const QByteArray &data) const = 0;
+};
+
+/*
+ * Snapshot of the counters of a mount, see
+ * SqlFileEngineHandler::statistics(). Counters are updated without
+ * locking, so a snapshot taken while engines are busy is not exact.
+ */
+struct SqlFsStatistics
+{
+    enum Counter {
+        // Engines created on the mount
+        Engines,
+        // Path resolutions and the path components they looked up
+        Lookups,
+        LookupSteps,
+        NodeCacheHits,
+        NodeCacheMisses,
+        StatCacheHits,
+        StatCacheMisses,
+        // Chunks served from the chunk cache of an engine and chunks read
+        // from the database
+        ChunkCacheHits,
+        ChunkCacheMisses,
+        BytesRead,
+        BytesWritten,
+        // Contents written to the database by flushes and closes
+        BytesFlushed,
+        CounterCount
+    };
+
+    enum Operation {
+        Open,
+        Read,
+        Flush,
+        List,
+        OperationCount
+    };
+
+    // Latencies are counted in power of two buckets, bucket 0 holds calls
+    // below 1 us and bucket n those from 2^(n-1) us up to 2^n us.
+    static const int LatencyBuckets = 24;
+
+    SqlFsStatistics();
+
+    // Fraction of hits, 0 if there were no lookups at all
+    static double hitRate(qint64 hits, qint64 misses);
+    // Upper bound in us of the bucket holding the given fraction of calls
+    qint64 percentile(Operation operation, double fraction) const;
+    qint64 calls(Operation operation) const;
+
+    // Summary for logs
+    QString toString() const;
+
+    qint64 counters[CounterCount];
+    // Executions indexed by SqlFileEngineHandler::Statement
+    QVector<qint64> statements;
+    qint64 latencies[OperationCount][LatencyBuckets];
+};
+
+/*
+ * Result of SqlFileEngineHandler::search(), the snippet is the matching
+ * part of the content with the matched terms in brackets.
+ */
+struct SqlFsMatch
+{
+    QString path;
+    QString snippet;
+};
+
 
 class SqlFileEngineHandler : public QAbstractFileEngineHandler
 {
 public:
-     QAbstractFileEngine *create(const QString &fileName) const;
+    enum Statement {
+        SelectStat,
+        SelectMetadata,
+        SelectRoot,
+        SelectChild,
+        SelectPath,
+        SelectChildren,
+        CountChildren,
+        SelectChunk,
+        SelectLegacyChunk,
+        SelectChunkRows,
+        InsertNode,
+        MoveNode,
+        UpdateMetadata,
+        ClearData,
+        DeleteNode,
+        ReplaceChunk,
+        UpdateChunk,
+        InsertBlob,
+        UpdateChunkBlob,
+        InsertChunkBlob,
+        DeleteChunks,
+        TruncateChunks,
+        ConvertLegacy,
+        DeleteTreeChunks,
+        DeleteTree,
+        SweepNodes,
+        SweepChunks,
+        CountBlobRefs,
+        SweepBlobs,
+        SelectTree,
+        SelectDataVersion,
+        SelectIndex,
+        SelectChanges,
+        DeleteText,
+        InsertText,
+        DeleteTreeText,
+        SearchText,
+        StatementCount
+    };
+
+    SqlFileEngineHandler();
+    ~SqlFileEngineHandler();
+
+    // The first handler created, used by SqlFs
+    static SqlFileEngineHandler *instance();
+
+    // Takes ownership, codecs have to be registered before files are used
+    void registerCodec(SqlFsCodec *codec);
+    const SqlFsCodec *codec(int id) const;
+    const SqlFsCodec *codec(const QString &name) const;
+
+    // Paths not starting with sql:/ are rejected without allocating
+    QAbstractFileEngine *create(const QString &fileName) const;
+
+    // Mounts a table of a connection, creating or migrating its schema
+    // right away instead of with the first engine on it. Fails if the
+    // connection is not open or the schema could not be migrated. Tables
+    // which were not added are mounted on first use.
+    bool addMount(const QString &connectionName, const QString &tableName,
+                  const SqlFsMountOptions &options = SqlFsMountOptions()) const;
+
+    // Connection to use in the calling thread. QtSql connections only work
+    // in the thread that created them, other threads get a clone with the
+    // same settings and pragmas, which is removed when the thread exits.
+    QSqlDatabase database(const QString &connectionName) const;
+
+    // State shared by all engines on one table of one connection
+    SqlFsMount *mount(const QString &connectionName, const QString &tableName) const;
+
+    SqlFsMountOptions mountOptions(const QString &connectionName,
+                                   const QString &tableName) const;
+    void setMountOptions(const QString &connectionName, const QString &tableName,
+                         const SqlFsMountOptions &options) const;
+
+    // Applies options given in the URL to their mount and returns the
+    // file name without them.
+    QString stripOptions(const QString &fileName) const;
+
+    // Prepared statements are cached per connection, table and statement
+    // in the thread of the connection. Callers pass the mount of the table,
+    // bind and execute them and have to finish() select queries.
+    QSqlQuery &query(const QSqlDatabase &db, const QString &tableName,
+                     Statement statement, SqlFsMount *mount) const;
+
+    // Drops all statements and caches of a connection, must be called by
+    // the thread of the connection before it is removed.
+    void releaseConnection(const QString &connectionName);
+
+    // Transaction batching on a connection, see SqlFsBatch
+    bool beginBatch(const QString &connectionName, int maxOps, qint64 maxBytes) const;
+    bool endBatch(const QString &connectionName, bool commit) const;
+
+    // Accounts a write operation to the batch running on the connection,
+    // if any, and commits intermediately once its thresholds are reached.
+    void batchStep(const QSqlDatabase &db, bool ok, qint64 bytes = 0) const;
+
+    // Waits until all contents queued by write-behind mounts are committed.
+    // Returns false if any of them failed since the last call.
+    bool sync() const;
+
+    // Write-behind queue, waiting for a node of -1 waits for the mount
+    void writeBehind(const SqlFsPendingWrite &write) const;
+    void waitForWrites(SqlFsMount *mount, int node = -1) const;
+
+    // Queues a request of the asynchronous API, takes ownership
+    void submit(SqlFsRequest *request) const;
+
+    // Deletes nodes unreachable from the table root together with their
+    // chunks, recounts blob references and drops unreferenced blobs.
+    // Cleans up after versions which left subtrees behind in rmdir().
+    bool sweep(const QString &connectionName, const QString &tableName) const;
+
+    // Frees up to pages pages of an auto_vacuum=INCREMENTAL database, 0
+    // frees all of them. A negative count runs a full VACUUM, which also
+    // applies a changed auto_vacuum mode. Fails inside of transactions.
+    bool vacuum(const QString &connectionName, int pages = -1) const;
+
+    // Queues an incremental vacuum after deletions on incremental mounts
+    void scheduleVacuum(const QString &connectionName, const QString &tableName) const;
+
+    // Counters, cache hit rates and latency histograms of a mount
+    SqlFsStatistics statistics(const QString &connectionName,
+                               const QString &tableName) const;
+    void resetStatistics(const QString &connectionName, const QString &tableName) const;
+
+    // Files below path whose content matches an FTS5 expression, best
+    // matches first. Only mounts with the fullText option are indexed.
+    QList<SqlFsMatch> search(const QString &path, const QString &expression,
+                             int limit = 100) const;
+
+private:
+    friend class SqlFsThreadConnections;
+    friend class SqlFsWriter;
+    friend class SqlFsAsync;
+    friend class SqlFsVacuumRequest;
+    friend class SqlFsWatcher;
+
+    // Update hook notifications of a table on the connection of the calling
+    // thread, reference counted as drivers subscribe only once
+    bool subscribe(const QString &connectionName, const QString &tableName) const;
+    void unsubscribe(const QString &connectionName, const QString &tableName) const;
+
+    // Creates the text index of a table and fills it with its files
+    bool createFullText(const QString &connectionName, const QString &tableName) const;
+
+    SqlFsThreadConnections *threadConnections() const;
+    QString cloneConnection(const QString &connectionName) const;
+    void releaseClone(const QString &cloneName) const;
+    void releaseThreadConnection(const QString &connectionName) const;
+    void releaseStatements(const QString &connectionName) const;
+
+    mutable QMutex m_mutex;
+    mutable QHash<QString, SqlFsMount *> m_mounts;
+    // Connection names of per thread clones mapped to their originals
+    mutable QHash<QString, QString> m_clones;
+    mutable QThreadStorage<SqlFsThreadConnections *> m_threadConnections;
+    mutable SqlFsWriter *m_writer;
+    mutable SqlFsAsync *m_async;
+    QList<SqlFsCodec *> m_codecs;
+
+    static SqlFileEngineHandler *s_instance;
+    mutable QHash<QString, SqlFsBatchState *> m_batches;
+    // Connections with a vacuum queued
+    mutable QSet<QString> m_vacuums;
+    // Watcher subscriptions by thread connection and table
+    mutable QHash<QString, int> m_subscriptions;
+};
+
+/*
+ * Groups all sqlfs operations on a connection into one transaction
+ * instead of one per file.  The transaction is committed when the batch
+ * goes out of scope, intermediately whenever maxOps operations or
+ * maxBytes of content have been written, and rolled back if any
+ * operation failed.  Rollback only covers the operations since the
+ * last intermediate commit.  Batches on the same connection nest.
+ *
+ *     SqlFsBatch batch(&handler, "sql:/fsdb/files");
+ *     foreach (...)
+ *         QFile(...).write(...);
+ *     batch.commit();
+ */
+class SqlFsBatch
+{
+public:
+    static const int DefaultMaxOps = 10000;
+    static const qint64 DefaultMaxBytes = 64 * 1024 * 1024;
+
+    SqlFsBatch(const SqlFileEngineHandler *handler, const QString &path,
+               int maxOps = DefaultMaxOps, qint64 maxBytes = DefaultMaxBytes);
+    ~SqlFsBatch();
+
+    bool isActive() const;
+    bool commit();
+    void rollback();
+
+private:
+    Q_DISABLE_COPY(SqlFsBatch)
+
+    const SqlFileEngineHandler *m_handler;
+    QString m_connectionName;
+    bool m_active;
+};
+
+/*
+ * Asynchronous access to sqlfs paths. Requests run on a database thread
+ * of SqlFileEngineHandler::instance(), requests submitted while it is
+ * busy are executed together in one transaction per connection. Pending
+ * requests are skipped when their future is canceled. Failed reads give
+ * a null QByteArray, failed writes false.
+ *
+ * The thread works on a clone of the connection, so the database has to
+ * be a file.
+ */
+class SqlFs
+{
+public:
+    static QFuture<QByteArray> readAll(const QString &path);
+    static QFuture<bool> writeAll(const QString &path, const QByteArray &data);
+    // Names only, QFileInfo objects would be bound to the database thread
+    static QFuture<QStringList> entryList(const QString &path,
+                                          QDir::Filters filters = QDir::NoFilter);
+};
+
+/*
+ * Bulk transfer between a host directory tree and a sqlfs directory.
+ * Host files are read and written by a thread pool while the calling
+ * thread does the database side with prepared statements in batches, see
+ * SqlFsBatch. Directory rows are created before any file. Existing files
+ * are overwritten, other entries are kept.
+ *
+ *     SqlFsPack pack(&handler);
+ *     pack.pack("/srv/assets", "sql:/fsdb/assets?dedup=1/v2");
+ */
+class SqlFsPack
+{
+public:
+    // Files up to this size are read or written by the thread pool, larger
+    // ones are streamed chunk by chunk by the calling thread
+    static const qint64 MaxPooledFile = 16 * 1024 * 1024;
+    // Content held in memory between the pool and the database
+    static const qint64 MaxPendingBytes = 256 * 1024 * 1024;
+
+    explicit SqlFsPack(const SqlFileEngineHandler *handler = SqlFileEngineHandler::instance());
+
+    // Threads of the pool, 0 uses QThread::idealThreadCount()
+    void setThreadCount(int threadCount);
+
+    bool pack(const QString &sourceDir, const QString &path);
+    bool unpack(const QString &path, const QString &destDir);
+
+    // Results of the last pack() or unpack()
+    int fileCount() const;
+    qint64 byteCount() const;
+    QString errorString() const;
+
+private:
+    Q_DISABLE_COPY(SqlFsPack)
+
+    bool fail(const QString &error);
+    int resolve(const QSqlDatabase &db, const QStringList &path);
+    int makeNode(const QSqlDatabase &db, const QString &tableName, int parent,
+                 const QString &name, bool directory);
+    bool storeFile(const QSqlDatabase &db, const QString &tableName, int parent,
+                   const QString &name, QIODevice *device);
+
+    const SqlFileEngineHandler *m_handler;
+    // Mount of the running pack() or unpack()
+    SqlFsMount *m_mount;
+    int m_threadCount;
+    int m_fileCount;
+    qint64 m_byteCount;
+    QString m_errorString;
+};
+
+/*
+ * Reports changes of sql:/ files and directories like QFileSystemWatcher.
+ * Changes made through the connection of the watcher's thread arrive by
+ * the update hook of the QSQLITE driver as soon as the event loop runs.
+ * Commits of other connections and processes are noticed every interval
+ * milliseconds by PRAGMA data_version and the change counter sqlfs keeps
+ * per table, which costs no more than a pragma while nothing changes.
+ *
+ *     SqlFsWatcher watcher;
+ *     watcher.addPath("sql:/fsdb/qml/main.qml");
+ *     connect(&watcher, SIGNAL(fileChanged(QString)), ...);
+ */
+class SqlFsWatcher : public QObject
+{
+    Q_OBJECT
+
+public:
+    static const int DefaultInterval = 500;
+
+    explicit SqlFsWatcher(const SqlFileEngineHandler *handler = SqlFileEngineHandler::instance(),
+                          QObject *parent = 0);
+    ~SqlFsWatcher();
+
+    // Paths have to exist. Files report changed contents and their removal,
+    // which also ends watching them, directories added, removed and renamed
+    // entries.
+    bool addPath(const QString &path);
+    QStringList addPaths(const QStringList &paths);
+    bool removePath(const QString &path);
+    QStringList removePaths(const QStringList &paths);
+
+    QStringList files() const;
+    QStringList directories() const;
+
+    int interval() const;
+    void setInterval(int msecs);
+
+signals:
+    void fileChanged(const QString &path);
+    void directoryChanged(const QString &path);
+
+private slots:
+    void notified(const QString &name, QSqlDriver::NotificationSource source,
+                  const QVariant &payload);
+    void processNotifications();
+    void poll();
+
+private:
+    Q_DISABLE_COPY(SqlFsWatcher)
+
+    struct Watch
+    {
+        QString mountKey;
+        int node;
+        bool directory;
+        bool exists;
+        qint64 size;
+        QDateTime modified;
+        QStringList entries;
+    };
+
+    // Connection and table of watched paths with the state seen last
+    struct WatchedMount
+    {
+        QString connectionName;
+        QString tableName;
+        QPointer<QSqlDriver> driver;
+        bool subscribed;
+        qint64 dataVersion;
+        qint64 changes;
+        int watches;
+    };
+
+    Watch snapshot(const QString &path, const QString &mountKey) const;
+    void check(const QString &mountKey, const QSet<int> &nodes, bool external);
+    qint64 readDataVersion(const WatchedMount &mount) const;
+    qint64 readChanges(const WatchedMount &mount) const;
+    void release(const QString &mountKey);
+
+    const SqlFileEngineHandler *m_handler;
+    QTimer *m_pollTimer;
+    QTimer *m_notifyTimer;
+    QMap<QString, Watch> m_watches;
+    QHash<QString, WatchedMount> m_mounts;
+    // Nodes reported by the update hook per mount, not yet processed
+    QHash<QString, QSet<int> > m_notified;
 };
 
 class SqlFileEngine : public QAbstractFileEngine
 {
     friend class SqlFileEngineIterator;
+    friend class SqlFileEngineHandler;
+    friend class SqlFsWatcher;
 
 public:
-    explicit SqlFileEngine(const QString &fileName);
+    SqlFileEngine(const QString &fileName, const SqlFileEngineHandler *handler);
     ~SqlFileEngine();
 
     FileFlags fileFlags(FileFlags type) const;
+    QDateTime fileTime(FileTime time) const;
     QString fileName(FileName file) const;
     Iterator *beginEntryList(QDir::Filters filters, const QStringList &filterNames);
     bool open(QIODevice::OpenMode openMode);
@@ -53,6 +591,7 @@ public:
     bool rmdir(const QString &dirName, bool recurseParentDirectories) const;
     bool remove();
     bool rename(const QString &newName);
+    bool copy(const QString &newName);
     qint64 size() const;
     bool setSize(qint64 size);
     bool seek(qint64 pos);
@@ -60,18 +599,109 @@ public:
     qint64 read(char *data, qint64 maxlen);
     bool flush();
     bool close();
+    bool supportsExtension(Extension extension) const;
+    bool extension(Extension extension, const ExtensionOption *option = 0,
+                   ExtensionReturn *output = 0);
+
+    // File contents are stored in fixed size chunks in a companion table
+    // named <table>_chunks, keyed by (node, idx).
+    static const qint64 ChunkSize = 64 * 1024;
+    static QString chunkTableName(const QString &tableName);
+
+    // Deduplicated chunks live in <table>_blobs keyed by their SHA-256
+    // hash, chunk rows reference them and keep the reference counts.
+    static QString blobTableName(const QString &tableName);
+
+    // Text of files is indexed in the FTS5 table <table>_text by node id.
+    // Larger files and files which are not valid UTF-8 are left out.
+    static const qint64 MaxIndexedFile = 1024 * 1024;
+    static QString textTableName(const QString &tableName);
+
+    // Version of the table layout, older tables are migrated when mounted
+    static const int SchemaVersion = 5;
 
 private:
+    // Maximum number of chunks kept in memory per engine
+    static const int MaxCachedChunks = 16;
+    // Number of chunk rowids resolved per lookup
+    static const int ChunkRowWindow = 64;
+    // Files up to this size are mapped as a whole and shared by all
+    // mappings, larger ones get a copy of the mapped range
+    static const qint64 MaxSharedMapping = 64 * 1024 * 1024;
+
+    // Location of stored chunks for incremental blob I/O. Rows are -1 for
+    // holes, deduplicated chunks are read from their row in the blob table.
+    // Encoded chunks can only be loaded as a whole.
+    struct ChunkRow
+    {
+        ChunkRow(qint64 row = -1, qint64 blob = -1, bool encoded = false) :
+            row(row),
+            blob(blob),
+            encoded(encoded)
+        {
+        }
+
+        qint64 row;
+        qint64 blob;
+        bool encoded;
+    };
+
+    // Content handed out by map(), node is -1 for private copies
+    struct Mapping
+    {
+        int node;
+        QByteArray content;
+    };
+
     bool tableExists();
     bool loadFile();
+    bool loadMetadata() const;
+    bool loadStat(SqlFsStat *stat) const;
+    bool loadChunk(qint64 idx, QByteArray *chunk);
+    bool readChunk(SqlBlob *blob, SqlBlob *shared, qint64 idx, qint64 offset,
+                   char *data, qint64 len);
+    bool chunkRow(qint64 idx, ChunkRow *row);
+    QByteArray *cachedChunk(qint64 idx);
+    // Only final stores, e.g. of close(), refresh the text index
+    bool store(bool final);
+    bool storeBehind();
+    bool storeChunks();
+    bool loadText(QString *text);
+    bool updateText();
+    bool writeChunks();
+    const SqlFsCodec *mountCodec() const;
+    void markDirty(qint64 idx, int begin, int end);
+    bool convertLegacy();
+    uchar *mapRegion(qint64 offset, qint64 size, QFile::MemoryMapFlags flags);
+    bool unmapRegion(uchar *address);
+    bool readAt(qint64 pos, char *data, qint64 len);
+    bool transfer(const QString &newName, bool move);
+    int copyTree(const QString &destTable, bool attached, int parent,
+                 const QString &name, bool move, bool text) const;
+    bool indexCopies(const QString &destTable) const;
+    bool deleteTree(int node, QSqlDatabase db, SqlFsMount *mount,
+                    const QString &tableName) const;
+    bool inTree(int node) const;
+    static bool splitUrl(const QString &url, QString *connectionName, QString *path);
     QStringList splitPath(const QString &path) const;
-    void createTable(const QString &tableName, QSqlDatabase db) const;
+    void loadIndex() const;
+    static bool createTable(const SqlFileEngineHandler *handler,
+                            const QString &tableName, QSqlDatabase db);
+    static bool migrateTable(const QString &tableName, QSqlDatabase db, int version);
     int node(const QString &path, QSqlDatabase db=QSqlDatabase()) const;
+    int child(int parent, const QString &name, QSqlDatabase db,
+              SqlFsMount *mount, const QString &tableName) const;
+    QSqlQuery &query(SqlFileEngineHandler::Statement statement) const;
+    QSqlQuery &query(SqlFileEngineHandler::Statement statement,
+                     const QSqlDatabase &db, SqlFsMount *mount,
+                     const QString &tableName) const;
 
+    const SqlFileEngineHandler *m_handler;
+    SqlFsMount *m_mount;
     QIODevice::OpenMode m_openMode;
 
-    QRegExp m_urlRegExp;
     mutable QSqlDatabase m_db;
+    QString m_connectionName;
     QString m_absoluteFileName;
     QString m_tableName;
     QString m_filePath;
@@ -79,8 +709,31 @@ private:
     QString m_fileName;
     int m_nodeId;
 
-    QByteArray m_buffer;
+    // Byte range [first, second) of a chunk modified since the last store
+    typedef QPair<int, int> DirtyRange;
+
+    QHash<qint64, QByteArray> m_chunks;
+    QHash<qint64, DirtyRange> m_dirtyChunks;
+    QHash<qint64, ChunkRow> m_chunkRows;
+    // Active mappings by address, mapping a range twice is allowed
+    QHash<uchar *, Mapping> m_mappings;
+    mutable qint64 m_size;
     qint64 m_pos;
+    // Size and storage layout are loaded on first use
+    mutable bool m_loaded;
+    // Content still lives in the node's data column (pre chunk tables)
+    mutable bool m_legacy;
+    // Content or size changed since the last flush()
+    bool m_modified;
+    // Content changed since the text was last indexed
+    bool m_textStale;
+    // Content bytes written since the last flush(), for batch accounting
+    qint64 m_storedBytes;
+    // Time of the last store for SqlFsMountOptions::FlushTimed
+    QElapsedTimer m_storeTimer;
+    // Chunks behind m_truncateIdx are pending for deletion on flush()
+    bool m_truncate;
+    qint64 m_truncateIdx;
 
 };
 
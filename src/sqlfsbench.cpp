@@ -0,0 +1,531 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 UVC Ingenieure http://uvc.de/
+ * Author: Max Holtzberg <mh@uvc.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <QtSql>
+#include <QtTest/QtTest>
+
+#include "sqlfileengine.h"
+#include "sqlfsbench.h"
+
+// Text resembling the QML, JSON and log files mounts usually hold
+static QByteArray textCorpus(int size)
+{
+    QByteArray text;
+    for (int i = 0; text.size() < size; i++) {
+        text += QString("{\"id\": %1, \"name\": \"item%2\", \"visible\": %3}\n"
+                        "Rectangle { id: rect%1; width: %4; height: %5 }\n"
+                        "2014-05-%6 12:%7:00 INFO loaded component %1\n")
+                .arg(i).arg(i % 97).arg(i % 2 ? "true" : "false")
+                .arg(i % 640).arg(i % 480).arg(i % 28 + 1).arg(i % 60)
+                .toUtf8();
+    }
+    text.truncate(size);
+    return text;
+}
+
+static double megabytesPerSecond(qint64 bytes, qint64 msecs)
+{
+    return bytes / 1048576.0 / qMax<qint64>(msecs, 1) * 1000.0;
+}
+
+// Block size of sequential transfers and of random accesses
+static const int BlockSize = 64 * 1024;
+static const int RandomBlockSize = 4 * 1024;
+static const int RandomAccesses = 256;
+
+// Every case runs against an in-memory database, a database file and the
+// native file system as baseline
+static QStringList backends()
+{
+    return QStringList() << "memory" << "disk" << "native";
+}
+
+static void addRows(const QString &parameter, const QList<int> &values)
+{
+    QTest::addColumn<QString>("backend");
+    QTest::addColumn<int>("value");
+
+    foreach (const QString &backend, backends()) {
+        foreach (int value, values) {
+            QString name = QString("%1 %2 %3").arg(backend).arg(parameter).arg(value);
+            QTest::newRow(qPrintable(name)) << backend << value;
+        }
+    }
+}
+
+static void addBackendRows()
+{
+    QTest::addColumn<QString>("backend");
+
+    foreach (const QString &backend, backends())
+        QTest::newRow(qPrintable(backend)) << backend;
+}
+
+static bool makePath(const QString &path)
+{
+    QDir dir(path);
+    return dir.exists() || dir.mkpath(path);
+}
+
+static bool writeFile(const QString &path, const QByteArray &data)
+{
+    QFile file(path);
+    return file.open(QIODevice::WriteOnly | QIODevice::Truncate) &&
+            file.write(data) == data.size();
+}
+
+// Offsets of random accesses, the same for every run
+static qint64 randomOffset(int i, qint64 size)
+{
+    return (qint64(i) * 2654435761u) % (size - RandomBlockSize);
+}
+
+// Reads a set of files completely, several of them run concurrently
+class ReaderThread : public QThread
+{
+public:
+    ReaderThread(const QStringList &files) :
+        m_files(files),
+        m_ok(true)
+    {
+    }
+
+    bool ok() const
+    {
+        return m_ok;
+    }
+
+protected:
+    void run()
+    {
+        foreach (const QString &path, m_files) {
+            QFile file(path);
+            m_ok = m_ok && file.open(QIODevice::ReadOnly) && !file.readAll().isNull();
+        }
+    }
+
+private:
+    QStringList m_files;
+    bool m_ok;
+};
+
+void SqlFsBench::initTestCase()
+{
+    QVERIFY(m_dir.isValid());
+
+    QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", "benchdb");
+    db.setDatabaseName(m_dir.path() + "/bench.db");
+    QVERIFY2(db.open(), "Could not open database");
+
+    QSqlDatabase memory = QSqlDatabase::addDatabase("QSQLITE", "benchmem");
+    memory.setDatabaseName(":memory:");
+    QVERIFY2(memory.open(), "Could not open database");
+
+    m_handler = new SqlFileEngineHandler();
+
+    // The database file runs in the mode recommended for it
+    SqlFsMountOptions options;
+    options.journalMode = "WAL";
+    options.synchronous = "NORMAL";
+    foreach (const QString &test, QStringList() << "stat" << "open" << "listing"
+             << "sequential" << "random" << "create" << "copy" << "rename"
+             << "remove" << "threads")
+        m_handler->setMountOptions("benchdb", test, options);
+}
+
+void SqlFsBench::cleanupTestCase()
+{
+    m_handler->releaseConnection("benchdb");
+    QSqlDatabase::database("benchdb").close();
+    QSqlDatabase::removeDatabase("benchdb");
+    m_handler->releaseConnection("benchmem");
+    QSqlDatabase::database("benchmem").close();
+    QSqlDatabase::removeDatabase("benchmem");
+    delete m_handler;
+}
+
+QString SqlFsBench::basePath(const QString &backend, const QString &test) const
+{
+    if (backend == "memory")
+        return "sql:/benchmem/" + test;
+    if (backend == "disk")
+        return "sql:/benchdb/" + test;
+    return m_dir.path() + "/native/" + test;
+}
+
+void SqlFsBench::stat_data()
+{
+    addRows("depth", QList<int>() << 1 << 4 << 16);
+}
+
+void SqlFsBench::stat()
+{
+    QFETCH(QString, backend);
+    QFETCH(int, value);
+
+    QString path = basePath(backend, "stat");
+    for (int i = 1; i < value; i++)
+        path += QString("/dir%1").arg(i);
+    QVERIFY(makePath(path));
+    path += "/file";
+    QVERIFY(writeFile(path, "stat"));
+
+    QBENCHMARK {
+        QFileInfo info(path);
+        QCOMPARE(info.size(), qint64(4));
+    }
+}
+
+void SqlFsBench::open_data()
+{
+    addRows("depth", QList<int>() << 1 << 4 << 16);
+}
+
+void SqlFsBench::open()
+{
+    QFETCH(QString, backend);
+    QFETCH(int, value);
+
+    QString path = basePath(backend, "open");
+    for (int i = 1; i < value; i++)
+        path += QString("/dir%1").arg(i);
+    QVERIFY(makePath(path));
+    path += "/file";
+    QVERIFY(writeFile(path, "open"));
+
+    QBENCHMARK {
+        QFile file(path);
+        QVERIFY(file.open(QIODevice::ReadOnly));
+        file.close();
+    }
+}
+
+void SqlFsBench::listing_data()
+{
+    addRows("entries", QList<int>() << 10 << 1000 << 10000);
+}
+
+void SqlFsBench::listing()
+{
+    QFETCH(QString, backend);
+    QFETCH(int, value);
+
+    QString path = basePath(backend, "listing") + QString("/dir%1").arg(value);
+    QVERIFY(makePath(path));
+    {
+        SqlFsBatch batch(m_handler, path);
+        for (int i = 0; i < value; i++)
+            QVERIFY(writeFile(QString("%1/file%2").arg(path).arg(i), QByteArray()));
+    }
+
+    QBENCHMARK {
+        QCOMPARE(QDir(path).entryInfoList(QDir::Files).size(), value);
+    }
+}
+
+void SqlFsBench::sequentialWrite_data()
+{
+    addRows("KB", QList<int>() << 64 << 1024 << 16 * 1024);
+}
+
+void SqlFsBench::sequentialWrite()
+{
+    QFETCH(QString, backend);
+    QFETCH(int, value);
+
+    QVERIFY(makePath(basePath(backend, "sequential")));
+    QString path = basePath(backend, "sequential") + QString("/write%1").arg(value);
+    QByteArray block = textCorpus(BlockSize);
+
+    QBENCHMARK {
+        QFile file(path);
+        QVERIFY(file.open(QIODevice::WriteOnly | QIODevice::Truncate));
+        for (qint64 done = 0; done < value * 1024; done += BlockSize)
+            QVERIFY(file.write(block) == BlockSize);
+        file.close();
+    }
+}
+
+void SqlFsBench::sequentialRead_data()
+{
+    addRows("KB", QList<int>() << 64 << 1024 << 16 * 1024);
+}
+
+void SqlFsBench::sequentialRead()
+{
+    QFETCH(QString, backend);
+    QFETCH(int, value);
+
+    QVERIFY(makePath(basePath(backend, "sequential")));
+    QString path = basePath(backend, "sequential") + QString("/read%1").arg(value);
+    QVERIFY(writeFile(path, textCorpus(value * 1024)));
+    QByteArray block(BlockSize, 0);
+
+    QBENCHMARK {
+        QFile file(path);
+        QVERIFY(file.open(QIODevice::ReadOnly));
+        qint64 done = 0;
+        for (qint64 n; (n = file.read(block.data(), BlockSize)) > 0;)
+            done += n;
+        QCOMPARE(done, qint64(value) * 1024);
+    }
+}
+
+void SqlFsBench::randomWrite_data()
+{
+    addRows("KB", QList<int>() << 1024 << 16 * 1024);
+}
+
+void SqlFsBench::randomWrite()
+{
+    QFETCH(QString, backend);
+    QFETCH(int, value);
+
+    QVERIFY(makePath(basePath(backend, "random")));
+    QString path = basePath(backend, "random") + QString("/write%1").arg(value);
+    QVERIFY(writeFile(path, textCorpus(value * 1024)));
+    QByteArray block = textCorpus(RandomBlockSize);
+
+    QBENCHMARK {
+        QFile file(path);
+        QVERIFY(file.open(QIODevice::ReadWrite));
+        for (int i = 0; i < RandomAccesses; i++) {
+            QVERIFY(file.seek(randomOffset(i, value * 1024)));
+            QVERIFY(file.write(block) == RandomBlockSize);
+        }
+        file.close();
+    }
+}
+
+void SqlFsBench::randomRead_data()
+{
+    addRows("KB", QList<int>() << 1024 << 16 * 1024);
+}
+
+void SqlFsBench::randomRead()
+{
+    QFETCH(QString, backend);
+    QFETCH(int, value);
+
+    QVERIFY(makePath(basePath(backend, "random")));
+    QString path = basePath(backend, "random") + QString("/read%1").arg(value);
+    QVERIFY(writeFile(path, textCorpus(value * 1024)));
+    QByteArray block(RandomBlockSize, 0);
+
+    QBENCHMARK {
+        QFile file(path);
+        QVERIFY(file.open(QIODevice::ReadOnly));
+        for (int i = 0; i < RandomAccesses; i++) {
+            QVERIFY(file.seek(randomOffset(i, value * 1024)));
+            QVERIFY(file.read(block.data(), RandomBlockSize) == RandomBlockSize);
+        }
+    }
+}
+
+void SqlFsBench::createFiles_data()
+{
+    QTest::addColumn<QString>("backend");
+    QTest::addColumn<int>("value");
+    QTest::addColumn<bool>("batched");
+
+    // Files get a transaction each unless they are created in a batch
+    foreach (const QString &backend, backends()) {
+        QString name = QString("%1 files 100").arg(backend);
+        QTest::newRow(qPrintable(name)) << backend << 100 << false;
+        if (backend != "native")
+            QTest::newRow(qPrintable(name + " batched")) << backend << 100 << true;
+    }
+}
+
+void SqlFsBench::createFiles()
+{
+    QFETCH(QString, backend);
+    QFETCH(int, value);
+    QFETCH(bool, batched);
+
+    // Every round creates new files in a directory of its own
+    QByteArray data = textCorpus(1024);
+    int round = 0;
+
+    QBENCHMARK {
+        QString path = basePath(backend, "create") + QString("/round%1").arg(round++);
+        QVERIFY(makePath(path));
+        QScopedPointer<SqlFsBatch> batch(batched ? new SqlFsBatch(m_handler, path) : 0);
+        for (int i = 0; i < value; i++)
+            QVERIFY(writeFile(QString("%1/file%2").arg(path).arg(i), data));
+        if (batch)
+            QVERIFY(batch->commit());
+    }
+}
+
+void SqlFsBench::copy_data()
+{
+    addRows("KB", QList<int>() << 4 << 16 * 1024);
+}
+
+void SqlFsBench::copy()
+{
+    QFETCH(QString, backend);
+    QFETCH(int, value);
+
+    QVERIFY(makePath(basePath(backend, "copy")));
+    QString path = basePath(backend, "copy") + QString("/file%1").arg(value);
+    QVERIFY(writeFile(path, textCorpus(value * 1024)));
+
+    QBENCHMARK {
+        QVERIFY(QFile::copy(path, path + ".copy"));
+        QVERIFY(QFile::remove(path + ".copy"));
+    }
+}
+
+void SqlFsBench::rename_data()
+{
+    addBackendRows();
+}
+
+void SqlFsBench::rename()
+{
+    QFETCH(QString, backend);
+
+    QString path = basePath(backend, "rename");
+    QVERIFY(makePath(path + "/a"));
+    QVERIFY(makePath(path + "/b"));
+    QVERIFY(writeFile(path + "/a/file", textCorpus(1024)));
+
+    QBENCHMARK {
+        QVERIFY(QFile::rename(path + "/a/file", path + "/b/moved"));
+        QVERIFY(QFile::rename(path + "/b/moved", path + "/a/file"));
+    }
+}
+
+void SqlFsBench::remove_data()
+{
+    addBackendRows();
+}
+
+void SqlFsBench::remove()
+{
+    QFETCH(QString, backend);
+
+    QString path = basePath(backend, "remove");
+    QVERIFY(makePath(path));
+    QByteArray data = textCorpus(1024);
+
+    // Measured together with creating the file again
+    QBENCHMARK {
+        QVERIFY(writeFile(path + "/file", data));
+        QVERIFY(QFile::remove(path + "/file"));
+    }
+}
+
+void SqlFsBench::threadedReads_data()
+{
+    addRows("threads", QList<int>() << 1 << 4);
+}
+
+void SqlFsBench::threadedReads()
+{
+    QFETCH(QString, backend);
+    QFETCH(int, value);
+
+    if (backend == "memory")
+        QSKIP("Clones of in-memory databases do not share their contents");
+
+    const int fileCount = 64;
+    QString path = basePath(backend, "threads");
+    QVERIFY(makePath(path));
+    QStringList files;
+    for (int i = 0; i < fileCount; i++) {
+        files.append(QString("%1/file%2").arg(path).arg(i));
+        if (!QFile::exists(files.last()))
+            QVERIFY(writeFile(files.last(), textCorpus(256 * 1024)));
+    }
+
+    // Every thread reads all files
+    QBENCHMARK {
+        QList<ReaderThread *> threads;
+        for (int i = 0; i < value; i++) {
+            threads.append(new ReaderThread(files));
+            threads.last()->start();
+        }
+        foreach (ReaderThread *thread, threads) {
+            thread->wait();
+            QVERIFY(thread->ok());
+            delete thread;
+        }
+    }
+}
+
+void SqlFsBench::compression_data()
+{
+    QTest::addColumn<QString>("codec");
+
+    QTest::newRow("raw") << QString();
+    QTest::newRow("zlib") << QString("zlib");
+}
+
+void SqlFsBench::compression()
+{
+    QFETCH(QString, codec);
+
+    const int fileCount = 64;
+    const int fileSize = 128 * 1024;
+    const QByteArray text = textCorpus(fileSize);
+    const QString table = codec.isEmpty() ? QString("raw") : codec;
+
+    SqlFsMountOptions options;
+    options.compression = codec;
+    m_handler->setMountOptions("benchdb", table, options);
+
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < fileCount; i++) {
+        QFile file(QString("sql:/benchdb/%1/file%2").arg(table).arg(i));
+        QVERIFY(file.open(QIODevice::WriteOnly));
+        QVERIFY(file.write(text) == text.size());
+        file.close();
+    }
+    qint64 writeTime = timer.restart();
+
+    for (int i = 0; i < fileCount; i++) {
+        QFile file(QString("sql:/benchdb/%1/file%2").arg(table).arg(i));
+        QVERIFY(file.open(QIODevice::ReadOnly));
+        QCOMPARE(file.readAll().size(), text.size());
+    }
+    qint64 readTime = timer.elapsed();
+
+    QSqlQuery qry(QSqlDatabase::database("benchdb"));
+    QVERIFY(qry.exec(QString("SELECT SUM(length(data)) FROM %1")
+                     .arg(SqlFileEngine::chunkTableName(table))) && qry.next());
+    qint64 stored = qry.value(0).toLongLong();
+    qry.finish();
+
+    qint64 total = qint64(fileCount) * fileSize;
+    qDebug("%s: ratio %.2f, write %.1f MB/s, read %.1f MB/s",
+           qPrintable(table), double(total) / qMax<qint64>(stored, 1),
+           megabytesPerSecond(total, writeTime), megabytesPerSecond(total, readTime));
+}
+
+QTEST_MAIN(SqlFsBench)
@@ -0,0 +1,78 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 UVC Ingenieure http://uvc.de/
+ * Author: Max Holtzberg <mh@uvc.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef SQLFSBENCH_H
+#define SQLFSBENCH_H
+
+#include <QTemporaryDir>
+#include <QtTest/QtTest>
+
+class SqlFileEngineHandler;
+
+class SqlFsBench : public QObject
+{
+    Q_OBJECT
+
+private:
+    QString basePath(const QString &backend, const QString &test) const;
+
+    SqlFileEngineHandler *m_handler;
+    QTemporaryDir m_dir;
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+
+    void stat_data();
+    void stat();
+    void open_data();
+    void open();
+    void listing_data();
+    void listing();
+    void sequentialWrite_data();
+    void sequentialWrite();
+    void sequentialRead_data();
+    void sequentialRead();
+    void randomWrite_data();
+    void randomWrite();
+    void randomRead_data();
+    void randomRead();
+    void createFiles_data();
+    void createFiles();
+    void copy_data();
+    void copy();
+    void rename_data();
+    void rename();
+    void remove_data();
+    void remove();
+    void threadedReads_data();
+    void threadedReads();
+
+    void compression_data();
+    void compression();
+
+};
+
+#endif // SQLFSBENCH_H
@@ -0,0 +1,99 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 UVC Ingenieure http://uvc.de/
+ * Author: Max Holtzberg <mh@uvc.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <QtCore>
+#include <QtSql>
+
+#include "sqlfileengine.h"
+
+/*
+ * Packs a host directory tree into a table of a SQLite database or
+ * unpacks it, see SqlFsPack:
+ *
+ *     sqlfspack pack assets.db "assets?journal_mode=WAL&dedup=1" ./assets
+ *     sqlfspack unpack assets.db assets/images ./images
+ */
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("sqlfspack");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Copies directory trees into sqlfs tables and back.");
+    parser.addHelpOption();
+    parser.addPositionalArgument("command", "pack or unpack");
+    parser.addPositionalArgument("database", "SQLite database file");
+    parser.addPositionalArgument("path", "Table and path inside of it, mount options "
+                                         "may follow the table name");
+    parser.addPositionalArgument("directory", "Host directory");
+    QCommandLineOption threads(QStringList() << "j" << "threads",
+                               "Threads reading or writing host files.", "count", "0");
+    parser.addOption(threads);
+    parser.process(app);
+
+    QStringList args = parser.positionalArguments();
+    if (args.size() != 4 || (args.at(0) != "pack" && args.at(0) != "unpack"))
+        parser.showHelp(1);
+
+    bool ok = false;
+    {
+        QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", "sqlfspack");
+        db.setDatabaseName(args.at(1));
+        if (!db.open()) {
+            qCritical("sqlfspack: could not open %s", qPrintable(args.at(1)));
+            return 1;
+        }
+
+        SqlFileEngineHandler handler;
+        SqlFsPack pack(&handler);
+        pack.setThreadCount(parser.value(threads).toInt());
+
+        QElapsedTimer timer;
+        timer.start();
+
+        QString path = "sql:/sqlfspack/" + args.at(2);
+        if (args.at(0) == "pack")
+            ok = pack.pack(args.at(3), path);
+        else
+            ok = pack.unpack(path, args.at(3));
+
+        qint64 elapsed = qMax<qint64>(timer.elapsed(), 1);
+        if (ok) {
+            QTextStream(stdout) << pack.fileCount() << " files, "
+                                << pack.byteCount() / (1024 * 1024) << " MB in "
+                                << elapsed << " ms ("
+                                << pack.byteCount() * 1000 / elapsed / (1024 * 1024)
+                                << " MB/s)" << endl;
+        } else {
+            qCritical("sqlfspack: %s", qPrintable(pack.errorString()));
+        }
+
+        handler.releaseConnection("sqlfspack");
+        db.close();
+    }
+    QSqlDatabase::removeDatabase("sqlfspack");
+
+    return ok ? 0 : 1;
+}
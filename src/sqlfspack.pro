@@ -0,0 +1,39 @@
+# The MIT License (MIT)
+#
+# Copyright (c) 2014 UVC Ingenieure http://uvc.de/
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+
+QT       += core core-private sql
+
+TARGET = sqlfspack
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+# Incremental blob I/O uses the SQLite handle of the QSQLITE driver, Qt has
+# to be configured with -system-sqlite for both to share one library.
+LIBS += -lsqlite3
+
+SOURCES = \
+    sqlfileengine.cpp \
+    sqlfspack.cpp
+
+HEADERS = \
+    sqlfileengine.h
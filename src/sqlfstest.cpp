@@ -35,13 +35,39 @@ void SqlFsTest::initTestCase()
     db.setDatabaseName(":memory:");
     QVERIFY2(db.open(), "Could not open database");
     m_handler = new SqlFileEngineHandler();
+    m_tempDir = new QTemporaryDir();
+    QVERIFY2(m_tempDir->isValid(), "Could not create temporary directory");
 }
 
 void SqlFsTest::cleanupTestCase()
 {
+    m_handler->releaseConnection("fsdb");
     QSqlDatabase::database("fsdb").close();
     QSqlDatabase::removeDatabase("fsdb");
     delete m_handler;
+    delete m_tempDir;
+}
+
+void SqlFsTest::cleanup()
+{
+    while (!m_connections.isEmpty()) {
+        QString name = m_connections.takeLast();
+        m_handler->releaseConnection(name);
+        QSqlDatabase::database(name, false).close();
+        QSqlDatabase::removeDatabase(name);
+    }
+}
+
+// Connections on files for WAL mode or clones, which in-memory databases
+// don't support. They are removed after the test by cleanup().
+QSqlDatabase SqlFsTest::openDatabase(const QString &connectionName, const QString &fileName)
+{
+    QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", connectionName);
+    db.setDatabaseName(m_tempDir->path() + '/' +
+                       (fileName.isEmpty() ? connectionName + ".db" : fileName));
+    m_connections.append(connectionName);
+    db.open();
+    return db;
 }
 
 void SqlFsTest::mkdir()
@@ -127,4 +153,1163 @@ void SqlFsTest::readWrite()
 
 }
 
+void SqlFsTest::largeFile()
+{
+    const qint64 chunk = SqlFileEngine::ChunkSize;
+
+    QByteArray data;
+    for (int i = 0; i < 3 * chunk + 123; i++)
+        data.append(static_cast<char>(i % 251));
+
+    QFile file("sql:/fsdb/tblname/large.bin");
+    QVERIFY(file.open(QIODevice::WriteOnly | QIODevice::Truncate));
+    QCOMPARE(file.write(data), qint64(data.size()));
+    file.close();
+
+    // Overwrite across a chunk boundary
+    QVERIFY(file.open(QIODevice::ReadWrite));
+    QCOMPARE(file.size(), qint64(data.size()));
+    QVERIFY(file.seek(chunk - 2));
+    QCOMPARE(file.write("abcd", 4), qint64(4));
+    data.replace(chunk - 2, 4, "abcd", 4);
+    file.close();
+
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    QVERIFY(file.readAll() == data);
+    QVERIFY(file.seek(2 * chunk + 10));
+    QVERIFY(file.read(100) == data.mid(2 * chunk + 10, 100));
+    file.close();
+
+    // Shrink and grow again, the gap has to read as zeros
+    QVERIFY(file.open(QIODevice::ReadWrite));
+    QVERIFY(file.resize(chunk + 7));
+    QVERIFY(file.resize(2 * chunk + 7));
+    file.close();
+
+    data.truncate(chunk + 7);
+    data.append(QByteArray(chunk, '\0'));
+
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    QCOMPARE(file.size(), qint64(data.size()));
+    QVERIFY(file.readAll() == data);
+    file.close();
+
+    QVERIFY(file.remove());
+    QVERIFY(!file.exists());
+}
+
+void SqlFsTest::legacyTable()
+{
+    // Tables written before chunk tables existed keep the content in the
+    // data column of the node itself.
+    QSqlQuery qry(QSqlDatabase::database("fsdb"));
+    QVERIFY(qry.exec("CREATE TABLE legacy (create_date INT, write_date INT, "
+                     "parent INT, name TEXT, flags INT, data BLOB)"));
+    QVERIFY(qry.exec("INSERT INTO legacy (rowid, parent, flags, name) "
+                     "VALUES (0, NULL, 0, 'legacy')"));
+
+    QByteArray data("Content stored in a single blob");
+    qry.prepare("INSERT INTO legacy (parent, flags, name, data) "
+                "VALUES (0, :flags, 'file', :data)");
+    qry.bindValue(":flags", static_cast<int>(
+            QAbstractFileEngine::FileType | QAbstractFileEngine::ExistsFlag |
+            QAbstractFileEngine::ReadUserPerm | QAbstractFileEngine::WriteUserPerm));
+    qry.bindValue(":data", data);
+    QVERIFY(qry.exec());
+
+    QFile file("sql:/fsdb/legacy/file");
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    QCOMPARE(file.size(), qint64(data.size()));
+    QVERIFY(file.readAll() == data);
+    file.close();
+
+    // Patched in place, the row keeps its layout
+    QVERIFY(file.open(QIODevice::ReadWrite));
+    QVERIFY(file.seek(8));
+    QCOMPARE(file.write("STORED", 6), qint64(6));
+    file.close();
+    data.replace(8, 6, "STORED", 6);
+
+    QVERIFY(qry.exec("SELECT data FROM legacy WHERE name='file'"));
+    QVERIFY(qry.next());
+    QVERIFY(qry.value(0).toByteArray() == data);
+    qry.finish();
+
+    QVERIFY(file.open(QIODevice::ReadWrite | QIODevice::Append));
+    QCOMPARE(file.write("!", 1), qint64(1));
+    file.close();
+
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    QVERIFY(file.readAll() == data + "!");
+    file.close();
+}
+
+void SqlFsTest::nodeCache()
+{
+    // Misses are cached, creating nodes has to invalidate them
+    QVERIFY(!QFile::exists("sql:/fsdb/tblname/cached/file"));
+
+    QDir dir("sql:/fsdb/tblname");
+    QVERIFY(dir.mkdir("cached"));
+
+    QFile file("sql:/fsdb/tblname/cached/file");
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    file.close();
+    QVERIFY(QFile::exists("sql:/fsdb/tblname/cached/file"));
+
+    QVERIFY(file.remove());
+    QVERIFY(!QFile::exists("sql:/fsdb/tblname/cached/file"));
+
+    QVERIFY(dir.mkpath("sql:/fsdb/tblname/cached/sub"));
+    QVERIFY(dir.exists("sql:/fsdb/tblname/cached/sub"));
+    QVERIFY(dir.rmpath("sql:/fsdb/tblname/cached/sub"));
+    QVERIFY(!dir.exists("sql:/fsdb/tblname/cached/sub"));
+    QVERIFY(dir.exists("sql:/fsdb/tblname/cached"));
+}
+
+static int totalChanges()
+{
+    QSqlQuery qry(QSqlDatabase::database("fsdb"));
+    if (!qry.exec("SELECT total_changes()") || !qry.next())
+        return -1;
+    return qry.value(0).toInt();
+}
+
+void SqlFsTest::readOnlyWrites()
+{
+    QFile file("sql:/fsdb/tblname/readonly");
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    QVERIFY(file.write(QByteArray(100000, 'x')) == 100000);
+    file.close();
+
+    // Reading must not write anything
+    int changes = totalChanges();
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    QCOMPARE(file.readAll().size(), 100000);
+    file.close();
+    QVERIFY(file.open(QIODevice::ReadWrite));
+    file.close();
+    QCOMPARE(totalChanges(), changes);
+
+    // Patching a few bytes updates the chunk in place
+    QVERIFY(file.open(QIODevice::ReadWrite));
+    QVERIFY(file.seek(70000));
+    QVERIFY(file.write("yy", 2) == 2);
+    file.close();
+    QVERIFY(totalChanges() > changes);
+
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    QByteArray data = file.readAll();
+    QCOMPARE(data.size(), 100000);
+    QVERIFY(data.mid(69999, 4) == "xyyx");
+    file.close();
+
+    QVERIFY(file.remove());
+}
+
+void SqlFsTest::listing()
+{
+    QDir dir("sql:/fsdb/tblname");
+    QVERIFY(dir.mkpath("sql:/fsdb/tblname/listing/sub"));
+
+    for (int i = 0; i < 10; i++) {
+        QFile file(QString("sql:/fsdb/tblname/listing/file%1").arg(i));
+        QVERIFY(file.open(QIODevice::WriteOnly));
+        QVERIFY(file.write(QByteArray(i * 1000, 'a')) == i * 1000);
+        file.close();
+    }
+
+    dir.setPath("sql:/fsdb/tblname/listing");
+    QFileInfoList list = dir.entryInfoList(QDir::Files, QDir::Name);
+    QCOMPARE(list.size(), 10);
+    for (int i = 0; i < list.size(); i++) {
+        QCOMPARE(list.at(i).fileName(), QString("file%1").arg(i));
+        QCOMPARE(list.at(i).size(), qint64(i * 1000));
+        QVERIFY(list.at(i).isFile());
+    }
+
+    list = dir.entryInfoList(QDir::Dirs | QDir::NoDotAndDotDot);
+    QCOMPARE(list.size(), 1);
+    QVERIFY(list.first().isDir());
+
+    QFileInfo info("sql:/fsdb/tblname/listing/file1");
+    QVERIFY(qAbs(info.lastModified().secsTo(QDateTime::currentDateTimeUtc())) < 60);
+    QVERIFY(info.birthTime().isValid());
+
+    // Cached stats have to follow modifications
+    QFile file("sql:/fsdb/tblname/listing/file3");
+    QVERIFY(file.open(QIODevice::WriteOnly | QIODevice::Truncate));
+    QVERIFY(file.write("abc", 3) == 3);
+    file.close();
+    QCOMPARE(QFileInfo("sql:/fsdb/tblname/listing/file3").size(), qint64(3));
+
+    QVERIFY(dir.removeRecursively());
+}
+
+void SqlFsTest::batch()
+{
+    const int count = 2000;
+
+    QDir dir("sql:/fsdb/tblname");
+    QVERIFY(dir.mkpath("sql:/fsdb/tblname/batch/batched"));
+
+    {
+        // Small thresholds to get intermediate commits as well
+        SqlFsBatch batch(m_handler, "sql:/fsdb/tblname", 500);
+        QVERIFY(batch.isActive());
+        for (int i = 0; i < count; i++) {
+            QFile file(QString("sql:/fsdb/tblname/batch/batched/file%1").arg(i));
+            QVERIFY(file.open(QIODevice::WriteOnly));
+            QVERIFY(file.write(QByteArray::number(i)) > 0);
+            file.close();
+        }
+        QVERIFY(batch.commit());
+    }
+
+    dir.setPath("sql:/fsdb/tblname/batch/batched");
+    QCOMPARE(dir.entryList(QDir::Files).size(), count);
+    QFile file("sql:/fsdb/tblname/batch/batched/file1234");
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    QCOMPARE(file.readAll(), QByteArray("1234"));
+    file.close();
+
+    // Rolled back files must not survive in the node cache
+    {
+        SqlFsBatch batch(m_handler, "sql:/fsdb/tblname");
+        QFile file("sql:/fsdb/tblname/batch/rolledback");
+        QVERIFY(file.open(QIODevice::WriteOnly));
+        QVERIFY(file.write("abc", 3) == 3);
+        file.close();
+        QVERIFY(QFile::exists("sql:/fsdb/tblname/batch/rolledback"));
+        batch.rollback();
+    }
+    QVERIFY(!QFile::exists("sql:/fsdb/tblname/batch/rolledback"));
+
+    dir.setPath("sql:/fsdb/tblname/batch");
+    QVERIFY(dir.removeRecursively());
+}
+
+void SqlFsTest::mountOptions()
+{
+    // WAL needs a database file, in memory databases ignore it
+    QSqlDatabase db = openDatabase("walfs");
+    QVERIFY(db.isOpen());
+
+    QFile file("sql:/walfs/files?journal_mode=WAL&synchronous=NORMAL&flush=close/a.txt");
+    QVERIFY(file.open(QIODevice::WriteOnly));
+
+    SqlFsMountOptions options = m_handler->mountOptions("walfs", "files");
+    QCOMPARE(options.journalMode, QString("WAL"));
+    QCOMPARE(options.synchronous, QString("NORMAL"));
+    QCOMPARE(options.flushPolicy, SqlFsMountOptions::FlushOnClose);
+
+    QSqlQuery qry(db);
+    QVERIFY(qry.exec("PRAGMA journal_mode") && qry.next());
+    QCOMPARE(qry.value(0).toString(), QString("wal"));
+
+    // Nothing hits the database before close()
+    QVERIFY(file.write("abc", 3) == 3);
+    QVERIFY(file.flush());
+    QVERIFY(qry.exec("SELECT COUNT(*) FROM files_chunks") && qry.next());
+    QCOMPARE(qry.value(0).toInt(), 0);
+
+    file.close();
+    QVERIFY(qry.exec("SELECT COUNT(*) FROM files_chunks") && qry.next());
+    QCOMPARE(qry.value(0).toInt(), 1);
+    qry.finish();
+
+    // Options stick to the mount, the plain URL sees the same file
+    QFile plain("sql:/walfs/files/a.txt");
+    QVERIFY(plain.open(QIODevice::ReadOnly));
+    QCOMPARE(plain.readAll(), QByteArray("abc"));
+    plain.close();
+
+    SqlFsMountOptions defaults;
+    m_handler->setMountOptions("walfs", "files", defaults);
+    QCOMPARE(m_handler->mountOptions("walfs", "files").flushPolicy,
+             SqlFsMountOptions::FlushAlways);
+
+    QVERIFY(!options.parse("synchronous=FAST;DROP"));
+
+    // Question marks below the table are part of the name
+    QFile question("sql:/walfs/files/what?.txt");
+    QVERIFY(question.open(QIODevice::WriteOnly));
+    QVERIFY(question.write("?", 1) == 1);
+    question.close();
+    QCOMPARE(QDir("sql:/walfs/files").entryList(QDir::Files),
+             QStringList() << "a.txt" << "what?.txt");
+    QCOMPARE(QFileInfo("sql:/walfs/files/what?.txt").size(), qint64(1));
+    QVERIFY(m_handler->mountOptions("walfs", "files") == defaults);
+}
+
+class FileThread : public QThread
+{
+public:
+    FileThread(int id) :
+        m_id(id),
+        m_ok(false)
+    {
+    }
+
+    bool isOk() const
+    {
+        return m_ok;
+    }
+
+protected:
+    void run()
+    {
+        m_ok = true;
+        for (int i = 0; i < 8; i++) {
+            QFile file(QString("sql:/threadfs/files/file%1").arg(i));
+            if (!file.open(QIODevice::ReadOnly) ||
+                    file.readAll() != QByteArray((i + 1) * 1000, 'a' + i))
+                m_ok = false;
+        }
+
+        QFile file(QString("sql:/threadfs/files/thread%1").arg(m_id));
+        if (!file.open(QIODevice::WriteOnly) ||
+                file.write(QByteArray::number(m_id)) <= 0)
+            m_ok = false;
+        file.close();
+    }
+
+private:
+    int m_id;
+    bool m_ok;
+};
+
+void SqlFsTest::threads()
+{
+    // Connections of other threads are clones, so the database has to be
+    // a file for them to share it.
+    QSqlDatabase db = openDatabase("threadfs");
+    QVERIFY(db.isOpen());
+
+    for (int i = 0; i < 8; i++) {
+        QFile file(QString("sql:/threadfs/files?journal_mode=WAL/file%1").arg(i));
+        QVERIFY(file.open(QIODevice::WriteOnly));
+        QVERIFY(file.write(QByteArray((i + 1) * 1000, 'a' + i)) == (i + 1) * 1000);
+        file.close();
+    }
+
+    QList<FileThread *> threads;
+    for (int i = 0; i < 4; i++) {
+        threads.append(new FileThread(i));
+        threads.last()->start();
+    }
+
+    foreach (FileThread *thread, threads) {
+        QVERIFY(thread->wait(30000));
+        QVERIFY(thread->isOk());
+    }
+    qDeleteAll(threads);
+
+    // Clones are gone with their threads
+    foreach (const QString &name, QSqlDatabase::connectionNames())
+        QVERIFY(!name.startsWith("threadfs@"));
+
+    for (int i = 0; i < 4; i++) {
+        QFile file(QString("sql:/threadfs/files/thread%1").arg(i));
+        QVERIFY(file.open(QIODevice::ReadOnly));
+        QCOMPARE(file.readAll(), QByteArray::number(i));
+    }
+}
+
+void SqlFsTest::writeBehind()
+{
+    // The writer thread works on a clone of the connection
+    QSqlDatabase db = openDatabase("behindfs");
+    QVERIFY(db.isOpen());
+
+    QDir dir("sql:/behindfs/files?journal_mode=WAL&write_behind=1");
+    QVERIFY(dir.mkpath("sql:/behindfs/files/docs"));
+
+    for (int i = 0; i < 20; i++) {
+        QFile file(QString("sql:/behindfs/files/docs/doc%1").arg(i));
+        QVERIFY(file.open(QIODevice::WriteOnly));
+        QByteArray data(100 * 1000, 'a' + i);
+        QVERIFY(file.write(data) == data.size());
+        file.close();
+    }
+
+    // Queued contents are visible right away
+    QCOMPARE(QFileInfo("sql:/behindfs/files/docs/doc7").size(), qint64(100 * 1000));
+    QFile file("sql:/behindfs/files/docs/doc7");
+    QVERIFY(file.open(QIODevice::ReadWrite));
+    QCOMPARE(file.readAll(), QByteArray(100 * 1000, 'h'));
+
+    // Rewrites are queued again
+    QVERIFY(file.resize(3));
+    QVERIFY(file.seek(0));
+    QVERIFY(file.write("xyz", 3) == 3);
+    file.close();
+
+    QVERIFY(m_handler->sync());
+
+    QSqlQuery qry(db);
+    QVERIFY(qry.exec("SELECT COUNT(*), SUM(length(data)) FROM files_chunks") && qry.next());
+    QCOMPARE(qry.value(0).toInt(), 19 * 2 + 1);
+    QCOMPARE(qry.value(1).toLongLong(), qint64(19 * 100 * 1000 + 3));
+    qry.finish();
+
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    QCOMPARE(file.readAll(), QByteArray("xyz"));
+    file.close();
+
+    // The writer would be blocked by an open batch, closes store
+    // within it instead
+    {
+        SqlFsBatch batch(m_handler, "sql:/behindfs/files");
+        QVERIFY(batch.isActive());
+        QFile batched("sql:/behindfs/files/docs/batched");
+        QVERIFY(batched.open(QIODevice::WriteOnly));
+        QVERIFY(batched.write("batched", 7) == 7);
+        batched.close();
+        QVERIFY(batch.commit());
+    }
+    QVERIFY(m_handler->sync());
+    QVERIFY(qry.exec("SELECT COUNT(*) FROM files_chunks c JOIN files n "
+                     "ON n.rowid=c.node WHERE n.name='batched'") && qry.next());
+    QCOMPARE(qry.value(0).toInt(), 1);
+    qry.finish();
+
+    // Clones of in-memory databases are empty, their mounts write through
+    QDir memDir("sql:/fsdb/behindmem?write_behind=1");
+    QVERIFY(memDir.mkpath("sql:/fsdb/behindmem/files"));
+    QVERIFY(!m_handler->mountOptions("fsdb", "behindmem").writeBehind);
+    QFile mem("sql:/fsdb/behindmem/files/mem.txt");
+    QVERIFY(mem.open(QIODevice::WriteOnly));
+    QVERIFY(mem.write("memory", 6) == 6);
+    mem.close();
+    QVERIFY(m_handler->sync());
+    QVERIFY(mem.open(QIODevice::ReadOnly));
+    QCOMPARE(mem.readAll(), QByteArray("memory"));
+    mem.close();
+}
+
+void SqlFsTest::asyncApi()
+{
+    // Requests run on a database thread working on a clone
+    QSqlDatabase db = openDatabase("asyncfs");
+    QVERIFY(db.isOpen());
+
+    QDir dir("sql:/asyncfs/files?journal_mode=WAL");
+    QVERIFY(dir.mkpath("sql:/asyncfs/files/assets"));
+
+    QList<QFuture<bool> > writes;
+    for (int i = 0; i < 50; i++) {
+        writes.append(SqlFs::writeAll(QString("sql:/asyncfs/files/assets/asset%1").arg(i),
+                                      QByteArray::number(i)));
+    }
+    foreach (QFuture<bool> future, writes)
+        QVERIFY(future.result());
+
+    QList<QFuture<QByteArray> > reads;
+    for (int i = 0; i < 50; i++)
+        reads.append(SqlFs::readAll(QString("sql:/asyncfs/files/assets/asset%1").arg(i)));
+    for (int i = 0; i < reads.size(); i++)
+        QCOMPARE(reads[i].result(), QByteArray::number(i));
+
+    QFuture<QStringList> list = SqlFs::entryList("sql:/asyncfs/files/assets", QDir::Files);
+    QCOMPARE(list.result().size(), 50);
+
+    QVERIFY(SqlFs::readAll("sql:/asyncfs/files/assets/missing").result().isNull());
+    QVERIFY(!QFile::exists("sql:/asyncfs/files/assets/missing"));
+
+    // Canceled requests finish without doing anything, unless they
+    // were already running.
+    QFuture<bool> canceled = SqlFs::writeAll("sql:/asyncfs/files/assets/canceled", "x");
+    canceled.cancel();
+    canceled.waitForFinished();
+    QVERIFY(canceled.isFinished());
+}
+
+static int rowCount(const QString &table)
+{
+    QSqlQuery qry(QSqlDatabase::database("fsdb"));
+    if (!qry.exec("SELECT COUNT(*) FROM " + table) || !qry.next())
+        return -1;
+    return qry.value(0).toInt();
+}
+
+static int lastRowid(const QString &table)
+{
+    QSqlQuery qry(QSqlDatabase::database("fsdb"));
+    if (!qry.exec("SELECT MAX(rowid) FROM " + table) || !qry.next())
+        return -1;
+    return qry.value(0).toInt();
+}
+
+void SqlFsTest::dedup()
+{
+    // Three full chunks and a partial one, all different
+    QByteArray data(3 * SqlFileEngine::ChunkSize + 1000, 0);
+    for (int i = 0; i < data.size(); i++)
+        data[i] = static_cast<char>(i % 251);
+
+    QFile a("sql:/fsdb/dedup?dedup=1/a");
+    QVERIFY(a.open(QIODevice::WriteOnly));
+    QVERIFY(a.write(data) == data.size());
+    a.close();
+    QCOMPARE(rowCount("dedup_blobs"), 4);
+
+    // Copies only reference the chunks of the original
+    QVERIFY(QFile::copy("sql:/fsdb/dedup/a", "sql:/fsdb/dedup/b"));
+    QCOMPARE(rowCount("dedup_blobs"), 4);
+    QCOMPARE(rowCount("dedup_chunks"), 8);
+    QCOMPARE(QFileInfo("sql:/fsdb/dedup/b").size(), qint64(data.size()));
+
+    // Identical content written separately is stored once as well
+    QFile c("sql:/fsdb/dedup/c");
+    QVERIFY(c.open(QIODevice::WriteOnly));
+    QVERIFY(c.write(data) == data.size());
+    c.close();
+    QCOMPARE(rowCount("dedup_blobs"), 4);
+
+    // Writes copy the shared chunk
+    QFile b("sql:/fsdb/dedup/b");
+    QVERIFY(b.open(QIODevice::ReadWrite));
+    QVERIFY(b.write("changed", 7) == 7);
+    b.close();
+    QCOMPARE(rowCount("dedup_blobs"), 5);
+
+    QVERIFY(a.open(QIODevice::ReadOnly));
+    QCOMPARE(a.readAll(), data);
+    a.close();
+
+    QVERIFY(b.open(QIODevice::ReadOnly));
+    QByteArray modified = data;
+    modified.replace(0, 7, "changed");
+    QCOMPARE(b.readAll(), modified);
+    b.close();
+
+    // Blobs go away with their last reference
+    QVERIFY(a.remove());
+    QVERIFY(c.remove());
+    QCOMPARE(rowCount("dedup_blobs"), 4);
+    QVERIFY(b.remove());
+    QCOMPARE(rowCount("dedup_blobs"), 0);
+    QCOMPARE(rowCount("dedup_chunks"), 0);
+}
+
+void SqlFsTest::compression()
+{
+    QByteArray text;
+    for (int i = 0; text.size() < 5 * SqlFileEngine::ChunkSize; i++)
+        text += QString("line %1: import QtQuick 2.0; Item { width: 100 }\n").arg(i).toUtf8();
+
+    QFile file("sql:/fsdb/compressed?compress=zlib/main.qml");
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    QVERIFY(file.write(text) == text.size());
+    file.close();
+
+    QSqlQuery qry(QSqlDatabase::database("fsdb"));
+    QVERIFY(qry.exec("SELECT COUNT(*), SUM(length(data)), MIN(encoding) "
+                     "FROM compressed_chunks") && qry.next());
+    QCOMPARE(qry.value(0).toLongLong(),
+             (text.size() + SqlFileEngine::ChunkSize - 1) / SqlFileEngine::ChunkSize);
+    QVERIFY(qry.value(1).toLongLong() * 4 < text.size());
+    QCOMPARE(qry.value(2).toInt(), 1);
+    qry.finish();
+
+    QCOMPARE(QFileInfo("sql:/fsdb/compressed/main.qml").size(), qint64(text.size()));
+
+    // Chunks are encoded one by one, seeking only decodes what is read
+    QVERIFY(file.open(QIODevice::ReadWrite));
+    QVERIFY(file.seek(3 * SqlFileEngine::ChunkSize - 10));
+    QCOMPARE(file.read(20), text.mid(3 * SqlFileEngine::ChunkSize - 10, 20));
+    QVERIFY(file.seek(100));
+    QVERIFY(file.write("patched", 7) == 7);
+    file.close();
+    text.replace(100, 7, "patched");
+
+    // Raw and encoded chunks mix within a table and a file
+    m_handler->setMountOptions("fsdb", "compressed", SqlFsMountOptions());
+    QVERIFY(file.open(QIODevice::Append));
+    QVERIFY(file.write("appended", 8) == 8);
+    file.close();
+    text += "appended";
+
+    QVERIFY(qry.exec("SELECT COUNT(*) FROM compressed_chunks WHERE encoding IS NULL") &&
+            qry.next());
+    QVERIFY(qry.value(0).toInt() > 0);
+    qry.finish();
+
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    QCOMPARE(file.readAll(), text);
+    file.close();
+    QVERIFY(file.remove());
+}
+
+void SqlFsTest::copyRename()
+{
+    QByteArray data(2 * SqlFileEngine::ChunkSize + 10, 'c');
+
+    QDir dir("sql:/fsdb/moves");
+    QVERIFY(dir.mkpath("sql:/fsdb/moves/src/sub"));
+    QVERIFY(dir.mkpath("sql:/fsdb/moves/src/inner"));
+
+    QFile file("sql:/fsdb/moves/src/a");
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    QVERIFY(file.write(data) == data.size());
+    file.close();
+
+    QFile gap("sql:/fsdb/moves/src/gap");
+    QVERIFY(gap.open(QIODevice::WriteOnly));
+    gap.close();
+
+    QFile sub("sql:/fsdb/moves/src/sub/b");
+    QVERIFY(sub.open(QIODevice::WriteOnly));
+    QVERIFY(sub.write("b", 1) == 1);
+    sub.close();
+
+    // Leaves a gap in the ids of the subtree
+    QVERIFY(gap.remove());
+
+    // Renames change the name as well as the parent
+    QVERIFY(QFile::rename("sql:/fsdb/moves/src/a", "sql:/fsdb/moves/src/a2"));
+    QVERIFY(!QFile::exists("sql:/fsdb/moves/src/a"));
+    QCOMPARE(QFileInfo("sql:/fsdb/moves/src/a2").size(), qint64(data.size()));
+
+    QVERIFY(dir.rename("src/sub", "sub2"));
+    QVERIFY(QFile::exists("sql:/fsdb/moves/sub2/b"));
+    QVERIFY(dir.rename("sub2", "src/sub"));
+
+    // A directory can't be moved into itself
+    QVERIFY(!dir.rename("src", "src/inner/src"));
+
+    // Directories are copied as a whole, chunks included. The copies get
+    // consecutive ids behind the last node.
+    int chunks = rowCount("moves_chunks");
+    int nodes = rowCount("moves");
+    int lastId = lastRowid("moves");
+    QVERIFY(QFile::copy("sql:/fsdb/moves/src", "sql:/fsdb/moves/copy"));
+    QCOMPARE(rowCount("moves_chunks"), 2 * chunks);
+    QCOMPARE(lastRowid("moves") - lastId, rowCount("moves") - nodes);
+
+    QFile copied("sql:/fsdb/moves/copy/a2");
+    QVERIFY(copied.open(QIODevice::ReadOnly));
+    QCOMPARE(copied.readAll(), data);
+    copied.close();
+    QVERIFY(QFile::exists("sql:/fsdb/moves/copy/sub/b"));
+    QVERIFY(QFileInfo("sql:/fsdb/moves/copy/inner").isDir());
+
+    // Moves to other tables copy the subtree and drop the original
+    QVERIFY(QFile::rename("sql:/fsdb/moves/copy", "sql:/fsdb/other/moved"));
+    QVERIFY(!QFile::exists("sql:/fsdb/moves/copy/a2"));
+    QCOMPARE(rowCount("moves_chunks"), chunks);
+
+    QFile moved("sql:/fsdb/other/moved/a2");
+    QVERIFY(moved.open(QIODevice::ReadOnly));
+    QCOMPARE(moved.readAll(), data);
+    moved.close();
+    QVERIFY(QFile::exists("sql:/fsdb/other/moved/sub/b"));
+
+    // Other database files are attached for the copy
+    QSqlDatabase db = openDatabase("attachfs");
+    QVERIFY(db.isOpen());
+
+    QVERIFY(QFile::copy("sql:/fsdb/moves/src", "sql:/attachfs/files/src"));
+
+    QFile attached("sql:/attachfs/files/src/a2");
+    QVERIFY(attached.open(QIODevice::ReadOnly));
+    QCOMPARE(attached.readAll(), data);
+    attached.close();
+}
+
+void SqlFsTest::removeTree()
+{
+    QByteArray data(2 * SqlFileEngine::ChunkSize, 'r');
+
+    QDir dir("sql:/fsdb/trash?dedup=1");
+    QVERIFY(dir.mkpath("sql:/fsdb/trash/a/b/c"));
+
+    QStringList files;
+    files << "a/one" << "a/b/two" << "a/b/c/three";
+    foreach (const QString &name, files) {
+        QFile file("sql:/fsdb/trash/" + name);
+        QVERIFY(file.open(QIODevice::WriteOnly));
+        QVERIFY(file.write(data + name.toUtf8()) == data.size() + name.size());
+        file.close();
+    }
+    QVERIFY(rowCount("trash_blobs") > 0);
+
+    // Nodes, chunks and blobs of the whole subtree are gone
+    QVERIFY(dir.rmpath("sql:/fsdb/trash/a"));
+    QVERIFY(!QFile::exists("sql:/fsdb/trash/a/b/c/three"));
+    QCOMPARE(rowCount("trash"), 1);
+    QCOMPARE(rowCount("trash_chunks"), 0);
+    QCOMPARE(rowCount("trash_blobs"), 0);
+
+    // Leftovers of earlier versions are swept
+    QSqlQuery qry(QSqlDatabase::database("fsdb"));
+    QVERIFY(qry.exec("INSERT INTO trash (parent, name, flags) VALUES (12345, 'lost', 0)"));
+    QVERIFY(qry.exec("INSERT INTO trash_chunks (node, idx, data) VALUES (12345, 0, 'x')"));
+    QVERIFY(qry.exec("INSERT INTO trash_blobs (hash, refs, data) VALUES ('h', 3, 'y')"));
+
+    QVERIFY(m_handler->sweep("fsdb", "trash"));
+    QCOMPARE(rowCount("trash"), 1);
+    QCOMPARE(rowCount("trash_chunks"), 0);
+    QCOMPARE(rowCount("trash_blobs"), 0);
+    QVERIFY(QDir("sql:/fsdb/trash").exists());
+}
+
+void SqlFsTest::vacuum()
+{
+    QSqlDatabase db = openDatabase("vacfs");
+    QVERIFY(db.isOpen());
+
+    QDir dir("sql:/vacfs/files?auto_vacuum=incremental&vacuum_pages=0");
+    QVERIFY(dir.mkpath("sql:/vacfs/files/big"));
+
+    QFile file("sql:/vacfs/files/big/data");
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    for (int i = 0; i < 64; i++)
+        QVERIFY(file.write(QByteArray(SqlFileEngine::ChunkSize, 'v')) == SqlFileEngine::ChunkSize);
+    file.close();
+
+    QVERIFY(dir.rmpath("sql:/vacfs/files/big"));
+
+    // Pages are freed on the thread of the asynchronous API, requests
+    // queued later finish after it
+    QVERIFY(SqlFs::entryList("sql:/vacfs/files",
+                              QDir::AllEntries | QDir::NoDotAndDotDot).result().isEmpty());
+
+    QSqlQuery qry(db);
+    QVERIFY(qry.exec("PRAGMA auto_vacuum") && qry.next());
+    QCOMPARE(qry.value(0).toInt(), 2);
+    QVERIFY(qry.exec("PRAGMA freelist_count") && qry.next());
+    QCOMPARE(qry.value(0).toInt(), 0);
+    qry.finish();
+
+    QVERIFY(m_handler->vacuum("vacfs"));
+}
+
+void SqlFsTest::map()
+{
+    QByteArray data(SqlFileEngine::ChunkSize + 100, 0);
+    for (int i = 0; i < data.size(); i++)
+        data[i] = static_cast<char>(i % 253);
+
+    QFile file("sql:/fsdb/mapped/asset");
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    QVERIFY(file.write(data) == data.size());
+    file.close();
+
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    uchar *address = file.map(10, SqlFileEngine::ChunkSize);
+    QVERIFY(address);
+    QCOMPARE(QByteArray(reinterpret_cast<char *>(address), SqlFileEngine::ChunkSize),
+             data.mid(10, SqlFileEngine::ChunkSize));
+    QVERIFY(!file.map(data.size() - 10, 20));
+
+    // Mappings of a file share its content
+    QFile other("sql:/fsdb/mapped/asset");
+    QVERIFY(other.open(QIODevice::ReadOnly));
+    uchar *shared = other.map(0, data.size());
+    QVERIFY(shared + 10 == address);
+    QVERIFY(other.unmap(shared));
+    QVERIFY(!other.unmap(shared));
+    other.close();
+
+    // Private mappings are copies
+    uchar *copy = file.map(0, 100, QFileDevice::MapPrivateOption);
+    QVERIFY(copy && copy + 10 != address);
+    copy[10] = ~copy[10];
+    QCOMPARE(address[0], static_cast<uchar>(data.at(10)));
+    QVERIFY(file.unmap(copy));
+    QVERIFY(file.unmap(address));
+    file.close();
+
+    // Shared mappings of writable files are refused, later mappings see
+    // the new content
+    QVERIFY(file.open(QIODevice::ReadWrite));
+    QVERIFY(!file.map(0, 10));
+    QVERIFY(file.write("new", 3) == 3);
+    file.close();
+
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    address = file.map(0, 3);
+    QVERIFY(address);
+    QCOMPARE(QByteArray(reinterpret_cast<char *>(address), 3), QByteArray("new"));
+    file.close();
+}
+
+static bool hasFts5()
+{
+    QSqlQuery qry(QSqlDatabase::database("fsdb"));
+    return qry.exec("SELECT sqlite_compileoption_used('ENABLE_FTS5')") && qry.next() &&
+            qry.value(0).toBool();
+}
+
+void SqlFsTest::pack()
+{
+    QTemporaryDir source;
+    QVERIFY(source.isValid());
+    QDir sourceDir(source.path());
+    QVERIFY(sourceDir.mkpath("images/icons"));
+    QVERIFY(sourceDir.mkpath("empty"));
+
+    QHash<QString, QByteArray> files;
+    files.insert("main.qml", "import QtQuick 2.0\n");
+    files.insert("images/logo.png", QByteArray(3 * SqlFileEngine::ChunkSize + 5, 'p'));
+    files.insert("images/icons/open.png", QByteArray(100, 'o'));
+    files.insert("images/icons/none.png", QByteArray());
+    foreach (const QString &name, files.keys()) {
+        QFile file(sourceDir.filePath(name));
+        QVERIFY(file.open(QIODevice::WriteOnly));
+        QVERIFY(file.write(files.value(name)) == files.value(name).size());
+    }
+
+    SqlFsPack pack(m_handler);
+    pack.setThreadCount(2);
+    QVERIFY(pack.pack(source.path(), "sql:/fsdb/packed/assets"));
+    QCOMPARE(pack.fileCount(), files.size());
+    QVERIFY(QFileInfo("sql:/fsdb/packed/assets/empty").isDir());
+
+    foreach (const QString &name, files.keys()) {
+        QFile file("sql:/fsdb/packed/assets/" + name);
+        QVERIFY(file.open(QIODevice::ReadOnly));
+        QCOMPARE(file.readAll(), files.value(name));
+    }
+
+    // Packing again replaces files and keeps directories
+    QVERIFY(pack.pack(source.path(), "sql:/fsdb/packed/assets"));
+    QCOMPARE(QFileInfo("sql:/fsdb/packed/assets/images/logo.png").size(),
+             qint64(files.value("images/logo.png").size()));
+
+    QTemporaryDir dest;
+    QVERIFY(dest.isValid());
+    QVERIFY(pack.unpack("sql:/fsdb/packed/assets", dest.path()));
+    QCOMPARE(pack.fileCount(), files.size());
+    QVERIFY(QDir(dest.path()).exists("empty"));
+
+    foreach (const QString &name, files.keys()) {
+        QFile file(QDir(dest.path()).filePath(name));
+        QVERIFY(file.open(QIODevice::ReadOnly));
+        QCOMPARE(file.readAll(), files.value(name));
+    }
+
+    QVERIFY(!pack.unpack("sql:/fsdb/packed/missing", dest.path()));
+
+    // Packed files are indexed, packing again replaces their text
+    if (hasFts5()) {
+        SqlFsMountOptions options;
+        options.fullText = true;
+        QVERIFY(m_handler->addMount("fsdb", "packedtext", options));
+        QVERIFY(pack.pack(source.path(), "sql:/fsdb/packedtext/assets"));
+        QList<SqlFsMatch> matches = m_handler->search("sql:/fsdb/packedtext", "QtQuick");
+        QCOMPARE(matches.size(), 1);
+        QCOMPARE(matches.at(0).path, QString("sql:/fsdb/packedtext/assets/main.qml"));
+
+        QFile main(sourceDir.filePath("main.qml"));
+        QVERIFY(main.open(QIODevice::WriteOnly | QIODevice::Truncate));
+        QVERIFY(main.write("import QtQml 2.0\n") > 0);
+        main.close();
+        QVERIFY(pack.pack(source.path(), "sql:/fsdb/packedtext/assets"));
+        QVERIFY(m_handler->search("sql:/fsdb/packedtext", "QtQuick").isEmpty());
+        QCOMPARE(m_handler->search("sql:/fsdb/packedtext", "QtQml").size(), 1);
+    }
+}
+
+void SqlFsTest::statistics()
+{
+    QByteArray data(2 * SqlFileEngine::ChunkSize, 's');
+    m_handler->resetStatistics("fsdb", "counted");
+
+    QFile file("sql:/fsdb/counted/file");
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    QVERIFY(file.write(data) == data.size());
+    file.close();
+
+    SqlFsStatistics stats = m_handler->statistics("fsdb", "counted");
+    QCOMPARE(stats.counters[SqlFsStatistics::BytesWritten], qint64(data.size()));
+    QCOMPARE(stats.counters[SqlFsStatistics::BytesFlushed], qint64(data.size()));
+    QCOMPARE(stats.calls(SqlFsStatistics::Open), qint64(1));
+    QCOMPARE(stats.calls(SqlFsStatistics::Flush), qint64(1));
+
+    // Statements are counted when executed, the contents are stored once
+    QCOMPARE(stats.statements[SqlFileEngineHandler::InsertNode], qint64(1));
+    QCOMPARE(stats.statements[SqlFileEngineHandler::UpdateMetadata], qint64(1));
+
+    m_handler->resetStatistics("fsdb", "counted");
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    QCOMPARE(file.readAll(), data);
+    file.close();
+    QCOMPARE(QFileInfo("sql:/fsdb/counted/file").size(), qint64(data.size()));
+
+    // The node of the file is cached since it was created
+    stats = m_handler->statistics("fsdb", "counted");
+    QCOMPARE(stats.counters[SqlFsStatistics::BytesRead], qint64(data.size()));
+    QCOMPARE(stats.counters[SqlFsStatistics::BytesWritten], qint64(0));
+    QCOMPARE(stats.statements[SqlFileEngineHandler::InsertNode], qint64(0));
+    QCOMPARE(stats.statements[SqlFileEngineHandler::UpdateMetadata], qint64(0));
+    QVERIFY(stats.counters[SqlFsStatistics::Engines] >= 1);
+    QVERIFY(stats.counters[SqlFsStatistics::NodeCacheHits] > 0);
+    QCOMPARE(stats.calls(SqlFsStatistics::Open), qint64(1));
+    QVERIFY(stats.calls(SqlFsStatistics::Read) > 0);
+    QVERIFY(stats.percentile(SqlFsStatistics::Read, 0.5) <=
+            stats.percentile(SqlFsStatistics::Read, 1));
+    QVERIFY(stats.toString().contains("read"));
+
+    m_handler->resetStatistics("fsdb", "counted");
+    stats = m_handler->statistics("fsdb", "counted");
+    QCOMPARE(stats.counters[SqlFsStatistics::BytesRead], qint64(0));
+    QCOMPARE(stats.calls(SqlFsStatistics::Read), qint64(0));
+    QCOMPARE(stats.percentile(SqlFsStatistics::Read, 0.5), qint64(0));
+}
+
+void SqlFsTest::mounts()
+{
+    // Tables are created when mounted, before any file is used
+    QVERIFY(m_handler->addMount("fsdb", "mounted"));
+    QSqlQuery qry(QSqlDatabase::database("fsdb"));
+    QVERIFY(qry.exec("SELECT version FROM sqlfs_meta WHERE name='mounted'"));
+    QVERIFY(qry.next());
+    QCOMPARE(qry.value(0).toInt(), SqlFileEngine::SchemaVersion);
+    qry.finish();
+    QVERIFY(QFileInfo("sql:/fsdb/mounted").isDir());
+
+    QVERIFY(!m_handler->addMount("nosuchdb", "files"));
+    QVERIFY(!m_handler->addMount("fsdb", "a/b"));
+
+    QVERIFY(!m_handler->create("/tmp/file"));
+    QVERIFY(!m_handler->create("sql:/fsdb"));
+    QVERIFY(!m_handler->create("sql:/fsdb/"));
+    QVERIFY(!m_handler->create("sql://mounted"));
+    QScopedPointer<QAbstractFileEngine> engine(m_handler->create("sql:/fsdb/mounted/file"));
+    QVERIFY(engine);
+    QVERIFY(!(engine->fileFlags(QAbstractFileEngine::ExistsFlag) &
+              QAbstractFileEngine::ExistsFlag));
+}
+
+class ExistsThread : public QThread
+{
+public:
+    ExistsThread(const QString &path) :
+        m_path(path),
+        m_exists(false)
+    {
+    }
+
+    bool exists() const
+    {
+        return m_exists;
+    }
+
+protected:
+    void run()
+    {
+        m_exists = QFileInfo(m_path).exists();
+    }
+
+private:
+    QString m_path;
+    bool m_exists;
+};
+
+void SqlFsTest::preload()
+{
+    QSqlDatabase db = openDatabase("prefs");
+    QVERIFY(db.isOpen());
+    QSqlDatabase other = openDatabase("prefsother", "prefs.db");
+    QVERIFY(other.isOpen());
+
+    QVERIFY(QDir("sql:/prefs/assets").mkpath("sql:/prefs/assets/qml/controls"));
+    QFile file("sql:/prefs/assets/qml/main.qml");
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    QVERIFY(file.write("main", 4) == 4);
+    file.close();
+
+    SqlFsMountOptions options;
+    options.preload = true;
+    QVERIFY(m_handler->addMount("prefs", "assets", options));
+
+    // Lookups, stats and listings are answered from memory
+    m_handler->resetStatistics("prefs", "assets");
+    QVERIFY(QFileInfo("sql:/prefs/assets/qml/main.qml").isFile());
+    QCOMPARE(QFileInfo("sql:/prefs/assets/qml/main.qml").size(), qint64(4));
+    QVERIFY(QFileInfo("sql:/prefs/assets/qml/controls").isDir());
+    QVERIFY(!QFileInfo("sql:/prefs/assets/qml/missing.qml").exists());
+    QDir::Filters filters = QDir::AllEntries | QDir::NoDotAndDotDot;
+    QCOMPARE(QDir("sql:/prefs/assets/qml").entryList(filters),
+             QStringList() << "controls" << "main.qml");
+
+    SqlFsStatistics stats = m_handler->statistics("prefs", "assets");
+    QCOMPARE(stats.statements[SqlFileEngineHandler::SelectRoot], qint64(0));
+    QCOMPARE(stats.statements[SqlFileEngineHandler::SelectChild], qint64(0));
+    QCOMPARE(stats.statements[SqlFileEngineHandler::SelectPath], qint64(0));
+    QCOMPARE(stats.statements[SqlFileEngineHandler::SelectStat], qint64(0));
+    QCOMPARE(stats.statements[SqlFileEngineHandler::SelectChildren], qint64(0));
+
+    // Changes of this process are followed
+    QFile created("sql:/prefs/assets/qml/new.qml");
+    QVERIFY(created.open(QIODevice::WriteOnly));
+    created.close();
+    QCOMPARE(QDir("sql:/prefs/assets/qml").entryList(filters),
+             QStringList() << "controls" << "main.qml" << "new.qml");
+    QVERIFY(QFile::remove("sql:/prefs/assets/qml/new.qml"));
+    QVERIFY(!QFileInfo("sql:/prefs/assets/qml/new.qml").exists());
+
+    // Changes of other connections reload the index
+    QSqlQuery qry(other);
+    QVERIFY(qry.exec("UPDATE assets SET name='renamed.qml' WHERE name='main.qml'"));
+    QVERIFY(QFileInfo("sql:/prefs/assets/qml/renamed.qml").isFile());
+    QVERIFY(!QFileInfo("sql:/prefs/assets/qml/main.qml").exists());
+
+    // Connections new to the index check the change counter, the clone
+    // of another thread is the first to use it after this commit
+    QVERIFY(qry.exec("UPDATE assets SET name='main.qml' WHERE name='renamed.qml'"));
+    ExistsThread thread("sql:/prefs/assets/qml/main.qml");
+    thread.start();
+    QVERIFY(thread.wait());
+    QVERIFY(thread.exists());
+    QVERIFY(QFileInfo("sql:/prefs/assets/qml/main.qml").isFile());
+}
+
+void SqlFsTest::watcher()
+{
+    QSqlDatabase db = openDatabase("watchfs");
+    QVERIFY(db.isOpen());
+    QSqlDatabase other = openDatabase("watchother", "watchfs.db");
+    QVERIFY(other.isOpen());
+
+    QString dirPath("sql:/watchfs/qml/app");
+    QString filePath = dirPath + "/main.qml";
+    QVERIFY(QDir("sql:/watchfs/qml").mkpath(dirPath));
+    QFile file(filePath);
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    QVERIFY(file.write("a", 1) == 1);
+    file.close();
+
+    SqlFsWatcher watcher(m_handler);
+    watcher.setInterval(20);
+    QVERIFY(!watcher.addPath("sql:/watchfs/qml/missing.qml"));
+    QVERIFY(watcher.addPath(filePath));
+    QVERIFY(watcher.addPath(dirPath));
+    QCOMPARE(watcher.files(), QStringList() << filePath);
+    QCOMPARE(watcher.directories(), QStringList() << dirPath);
+
+    QSignalSpy files(&watcher, SIGNAL(fileChanged(QString)));
+    QSignalSpy directories(&watcher, SIGNAL(directoryChanged(QString)));
+
+    // Changes of the same size within a second are reported as well
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    QVERIFY(file.write("b", 1) == 1);
+    file.close();
+    QVERIFY(files.wait());
+    QCOMPARE(files.takeFirst().at(0).toString(), filePath);
+    QCOMPARE(directories.count(), 0);
+
+    QFile created(dirPath + "/new.qml");
+    QVERIFY(created.open(QIODevice::WriteOnly));
+    created.close();
+    QVERIFY(directories.wait());
+    QCOMPARE(directories.takeFirst().at(0).toString(), dirPath);
+    QCOMPARE(files.count(), 0);
+
+    // Commits of other connections are polled
+    QSqlQuery qry(other);
+    QVERIFY(qry.exec("UPDATE qml SET name='renamed.qml' WHERE name='new.qml'"));
+    QVERIFY(directories.wait());
+    QCOMPARE(directories.takeFirst().at(0).toString(), dirPath);
+    QVERIFY(QFileInfo(dirPath + "/renamed.qml").exists());
+
+    // Removed files are reported once and no longer watched
+    QVERIFY(QFile::remove(filePath));
+    QVERIFY(files.wait());
+    QCOMPARE(files.takeFirst().at(0).toString(), filePath);
+    QCOMPARE(watcher.files(), QStringList());
+    QVERIFY(watcher.removePath(dirPath));
+    QVERIFY(!watcher.removePath(dirPath));
+}
+
+void SqlFsTest::fullText()
+{
+    if (!hasFts5())
+        QSKIP("SQLite lacks FTS5");
+
+    // Files stored before the index was enabled are indexed with it
+    QVERIFY(QDir("sql:/fsdb/docs").mkpath("sql:/fsdb/docs/notes"));
+    QFile old("sql:/fsdb/docs/readme.txt");
+    QVERIFY(old.open(QIODevice::WriteOnly));
+    QVERIFY(old.write("stored before indexing") > 0);
+    old.close();
+
+    SqlFsMountOptions options;
+    options.fullText = true;
+    QVERIFY(m_handler->addMount("fsdb", "docs", options));
+
+    // Files written as a whole are indexed from their buffers
+    m_handler->resetStatistics("fsdb", "docs");
+    QFile file("sql:/fsdb/docs/notes/todo.txt");
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    QVERIFY(file.write("remember the milk and the eggs") > 0);
+    file.close();
+    QCOMPARE(m_handler->statistics("fsdb", "docs").counters[SqlFsStatistics::BytesRead],
+             qint64(0));
+
+    // Binary content is left out
+    QFile binary("sql:/fsdb/docs/notes/image.bin");
+    QVERIFY(binary.open(QIODevice::WriteOnly));
+    QVERIFY(binary.write(QByteArray("milk\0eggs", 9)) == 9);
+    binary.close();
+
+    QList<SqlFsMatch> matches = m_handler->search("sql:/fsdb/docs", "milk");
+    QCOMPARE(matches.size(), 1);
+    QCOMPARE(matches.at(0).path, QString("sql:/fsdb/docs/notes/todo.txt"));
+    QCOMPARE(matches.at(0).snippet, QString("remember the [milk] and the eggs"));
+    QCOMPARE(m_handler->search("sql:/fsdb/docs", "indexing").size(), 1);
+
+    // Rewrites replace the indexed text
+    QVERIFY(file.open(QIODevice::WriteOnly | QIODevice::Truncate));
+    QVERIFY(file.write("buy bread") > 0);
+    file.close();
+    QVERIFY(m_handler->search("sql:/fsdb/docs", "milk").isEmpty());
+    QCOMPARE(m_handler->search("sql:/fsdb/docs/notes", "bread").size(), 1);
+    QVERIFY(m_handler->search("sql:/fsdb/docs/notes", "indexing").isEmpty());
+
+    // Flushes while appending leave the index to close()
+    QFile log("sql:/fsdb/docs/notes/log.txt");
+    QVERIFY(log.open(QIODevice::WriteOnly));
+    QVERIFY(log.write("first entry\n") > 0);
+    QVERIFY(log.flush());
+    QVERIFY(log.write("second entry\n") > 0);
+    QVERIFY(log.flush());
+    QVERIFY(m_handler->search("sql:/fsdb/docs/notes", "entry").isEmpty());
+    log.close();
+    QCOMPARE(m_handler->search("sql:/fsdb/docs/notes", "second").size(), 1);
+
+    // Copies are found under their new path, removed files are gone
+    QVERIFY(QFile::copy("sql:/fsdb/docs/notes/todo.txt", "sql:/fsdb/docs/copy.txt"));
+    QCOMPARE(m_handler->search("sql:/fsdb/docs", "bread").size(), 2);
+    QVERIFY(QFile::remove("sql:/fsdb/docs/copy.txt"));
+    QVERIFY(QDir("sql:/fsdb/docs/notes").removeRecursively());
+    QVERIFY(m_handler->search("sql:/fsdb/docs", "bread").isEmpty());
+    QCOMPARE(m_handler->search("sql:/fsdb/docs", "indexing").size(), 1);
+
+    // Copies from tables without index are indexed in the destination
+    QVERIFY(QDir("sql:/fsdb/plain").mkpath("sql:/fsdb/plain/letters"));
+    QFile letter("sql:/fsdb/plain/letters/letter.txt");
+    QVERIFY(letter.open(QIODevice::WriteOnly));
+    QVERIFY(letter.write("dear sir or madam") > 0);
+    letter.close();
+    QVERIFY(QFile::copy("sql:/fsdb/plain/letters", "sql:/fsdb/docs/letters"));
+    matches = m_handler->search("sql:/fsdb/docs", "madam");
+    QCOMPARE(matches.size(), 1);
+    QCOMPARE(matches.at(0).path, QString("sql:/fsdb/docs/letters/letter.txt"));
+
+    // Changes made while the index was off are picked up when it is on again
+    options.fullText = false;
+    m_handler->setMountOptions("fsdb", "docs", options);
+    QVERIFY(old.open(QIODevice::WriteOnly | QIODevice::Truncate));
+    QVERIFY(old.write("rewritten without index") > 0);
+    old.close();
+    options.fullText = true;
+    m_handler->setMountOptions("fsdb", "docs", options);
+    QVERIFY(m_handler->search("sql:/fsdb/docs", "indexing").isEmpty());
+    QCOMPARE(m_handler->search("sql:/fsdb/docs", "rewritten").size(), 1);
+}
+
 QTEST_MAIN(SqlFsTest)
@@ -36,15 +36,44 @@ class SqlFsTest : public QObject
     Q_OBJECT
 
 private:
+    QSqlDatabase openDatabase(const QString &connectionName,
+                              const QString &fileName = QString());
+
     SqlFileEngineHandler *m_handler;
+    QTemporaryDir *m_tempDir;
+    // Connections opened by the running test
+    QStringList m_connections;
 
 private slots:
     void initTestCase();
     void cleanupTestCase();
+    void cleanup();
 
     void mkdir();
     void rmdir();
     void readWrite();
+    void largeFile();
+    void legacyTable();
+    void nodeCache();
+    void readOnlyWrites();
+    void listing();
+    void batch();
+    void mountOptions();
+    void threads();
+    void writeBehind();
+    void asyncApi();
+    void dedup();
+    void compression();
+    void copyRename();
+    void removeTree();
+    void vacuum();
+    void map();
+    void pack();
+    void statistics();
+    void mounts();
+    void preload();
+    void watcher();
+    void fullText();
 
 };
 
@@ -24,6 +24,10 @@ QT       += core core-private sql testlib
 
 CONFIG += testcase
 
+# Incremental blob I/O uses the SQLite handle of the QSQLITE driver, Qt has
+# to be configured with -system-sqlite for both to share one library.
+LIBS += -lsqlite3
+
 TARGET = sqlfstest
 TEMPLATE = app
 